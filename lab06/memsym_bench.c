@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+// Throughput benchmark for memsym.
+//
+// For every locality mode a trace is generated once with tracegen, then
+// memsym is run over it with each TLB strategy. Only the memsym run is
+// timed; output goes to /dev/null so the number reflects parsing and
+// simulation cost. Reports simulated instructions per second.
+
+static const char* localities[] = { "zipf", "seq", "random" };
+static const char* strategies[] = { "FIFO", "LRU" };
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// fork/exec argv and wait; returns the child's exit status or -1
+static int run(char* const argv[]) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        execv(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) < 0) {
+        perror("waitpid");
+        return -1;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+int main(int argc, char* argv[]) {
+    const char usage[] =
+        "Usage: memsym_bench.out [-n instructions] [-s seed] [-w working set pages]\n"
+        "                        [-c ctxswitch period] [-u churn per mille] [-r repeats]\n"
+        "                        [-g tracegen binary] [-m memsym binary] [-d trace dir]\n";
+    const char* num_instructions = "10000000";
+    const char* seed = "1";
+    const char* working_set = "64";
+    const char* ctxswitch_period = "1000";
+    const char* churn = "5";
+    int repeats = 3;
+    const char* tracegen_bin = "./tracegen.out";
+    const char* memsym_bin = "./memsym.out";
+    const char* trace_dir = "/tmp";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:w:c:u:r:g:m:d:")) != -1) {
+        switch (opt) {
+        case 'n': num_instructions = optarg; break;
+        case 's': seed = optarg; break;
+        case 'w': working_set = optarg; break;
+        case 'c': ctxswitch_period = optarg; break;
+        case 'u': churn = optarg; break;
+        case 'r': repeats = atoi(optarg); break;
+        case 'g': tracegen_bin = optarg; break;
+        case 'm': memsym_bin = optarg; break;
+        case 'd': trace_dir = optarg; break;
+        default:
+            fprintf(stderr, "%s", usage);
+            return 1;
+        }
+    }
+    if (optind != argc || repeats < 1) {
+        fprintf(stderr, "%s", usage);
+        return 1;
+    }
+
+    double instructions = strtod(num_instructions, NULL);
+    printf("%-8s %-8s %12s %10s %14s\n", "locality", "strategy", "instructions", "seconds", "instr/s");
+
+    for (size_t l = 0; l < sizeof(localities) / sizeof(localities[0]); l++) {
+        char trace_path[4096];
+        snprintf(trace_path, sizeof(trace_path), "%s/memsym_bench_%d_%s.trace",
+                 trace_dir, (int)getpid(), localities[l]);
+
+        char* gen_argv[] = {
+            (char*)tracegen_bin, "-n", (char*)num_instructions, "-s", (char*)seed,
+            "-w", (char*)working_set, "-l", (char*)localities[l],
+            "-c", (char*)ctxswitch_period, "-u", (char*)churn, "-o", trace_path, NULL
+        };
+        if (run(gen_argv) != 0) {
+            fprintf(stderr, "Error: trace generation failed for %s\n", localities[l]);
+            return 1;
+        }
+
+        for (size_t s = 0; s < sizeof(strategies) / sizeof(strategies[0]); s++) {
+            char* sim_argv[] = {
+                (char*)memsym_bin, (char*)strategies[s], trace_path, "/dev/null", NULL
+            };
+            double best = 0.0;
+            for (int r = 0; r < repeats; r++) {
+                double start = now_seconds();
+                if (run(sim_argv) != 0) {
+                    fprintf(stderr, "Error: memsym failed on %s\n", trace_path);
+                    unlink(trace_path);
+                    return 1;
+                }
+                double elapsed = now_seconds() - start;
+                if (r == 0 || elapsed < best) {
+                    best = elapsed;
+                }
+            }
+            printf("%-8s %-8s %12.0f %10.3f %14.0f\n", localities[l], strategies[s],
+                   instructions, best, best > 0.0 ? instructions / best : 0.0);
+            fflush(stdout);
+        }
+
+        unlink(trace_path);
+    }
+
+    return 0;
+}
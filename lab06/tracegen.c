@@ -0,0 +1,259 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+
+// Synthetic trace generator for memsym.
+//
+// Produces a reproducible trace (same seed and parameters => same bytes) of
+// exactly -n non-comment instructions. Every memory access targets a page
+// that is mapped for the current process, so memsym never stops early on a
+// translation fault and the whole trace is simulated.
+
+#define NUM_PROCS 4
+
+enum { LOC_ZIPF, LOC_SEQ, LOC_RANDOM };
+
+typedef struct {
+    uint32_t* slot_vpn;   // working set: slot -> mapped VPN
+    uint8_t* in_use;      // VPN -> currently mapped by this process
+    uint64_t cursor;      // sequential mode: next word within the working set
+} proc_state;
+
+static uint64_t rng_state;
+
+// splitmix64: small, fast and fully determined by the seed
+static uint64_t rng_next(void) {
+    uint64_t z = (rng_state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static uint32_t rng_below(uint32_t bound) {
+    return (uint32_t)(((rng_next() >> 32) * (uint64_t)bound) >> 32);
+}
+
+static double rng_unit(void) {
+    return (double)(rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Cumulative distribution over working-set ranks for Zipf sampling
+static double* build_zipf_cdf(uint32_t n, double alpha) {
+    double* cdf = (double*)malloc(n * sizeof(double));
+    if (!cdf) {
+        perror("malloc");
+        exit(1);
+    }
+    double total = 0.0;
+    for (uint32_t i = 0; i < n; i++) {
+        total += 1.0 / pow((double)(i + 1), alpha);
+        cdf[i] = total;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        cdf[i] /= total;
+    }
+    return cdf;
+}
+
+static uint32_t zipf_sample(const double* cdf, uint32_t n) {
+    double u = rng_unit();
+    uint32_t lo = 0, hi = n - 1;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (cdf[mid] < u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static int parse_locality(const char* s) {
+    if (strcmp(s, "zipf") == 0) return LOC_ZIPF;
+    if (strcmp(s, "seq") == 0) return LOC_SEQ;
+    if (strcmp(s, "random") == 0) return LOC_RANDOM;
+    return -1;
+}
+
+int main(int argc, char* argv[]) {
+    const char usage[] =
+        "Usage: tracegen.out [-n instructions] [-s seed] [-w working set pages]\n"
+        "                    [-l zipf|seq|random] [-a zipf alpha] [-c ctxswitch period]\n"
+        "                    [-u churn per mille] [-O off bits] [-P pfn bits] [-V vpn bits]\n"
+        "                    [-o output trace]\n";
+    uint64_t num_instructions = 1000000;
+    uint64_t seed = 1;
+    uint32_t working_set = 64;
+    int locality = LOC_ZIPF;
+    double alpha = 1.0;
+    uint32_t ctxswitch_period = 1000;   // mean instructions between switches; 0 = never
+    uint32_t churn = 5;                 // map/unmap pairs per 1000 instructions
+    int off_bits = 8, pfn_bits = 12, vpn_bits = 12;
+    const char* output_trace = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:w:l:a:c:u:O:P:V:o:")) != -1) {
+        switch (opt) {
+        case 'n': num_instructions = strtoull(optarg, NULL, 10); break;
+        case 's': seed = strtoull(optarg, NULL, 10); break;
+        case 'w': working_set = (uint32_t)strtoul(optarg, NULL, 10); break;
+        case 'l':
+            locality = parse_locality(optarg);
+            if (locality < 0) {
+                fprintf(stderr, "Unknown locality %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'a': alpha = atof(optarg); break;
+        case 'c': ctxswitch_period = (uint32_t)strtoul(optarg, NULL, 10); break;
+        case 'u': churn = (uint32_t)strtoul(optarg, NULL, 10); break;
+        case 'O': off_bits = atoi(optarg); break;
+        case 'P': pfn_bits = atoi(optarg); break;
+        case 'V': vpn_bits = atoi(optarg); break;
+        case 'o': output_trace = optarg; break;
+        default:
+            fprintf(stderr, "%s", usage);
+            return 1;
+        }
+    }
+    if (optind != argc) {
+        fprintf(stderr, "%s", usage);
+        return 1;
+    }
+
+    // memsym keeps virtual addresses in an int and physical memory in RAM
+    if (off_bits < 1 || pfn_bits < 1 || vpn_bits < 1 ||
+        off_bits + vpn_bits > 30 || off_bits + pfn_bits > 28) {
+        fprintf(stderr, "Error: unsupported OFF/PFN/VPN bit widths\n");
+        return 1;
+    }
+    uint32_t num_pages = 1u << vpn_bits;
+    uint32_t num_frames = 1u << pfn_bits;
+    uint32_t page_words = 1u << off_bits;
+    if (working_set == 0 || working_set > num_pages) {
+        fprintf(stderr, "Error: working set must be between 1 and %u pages\n", num_pages);
+        return 1;
+    }
+
+    FILE* out = stdout;
+    if (output_trace) {
+        out = fopen(output_trace, "w");
+        if (!out) {
+            perror("Error opening output file");
+            return 1;
+        }
+    }
+    static char out_buffer[1 << 20];
+    setvbuf(out, out_buffer, _IOFBF, sizeof(out_buffer));
+
+    rng_state = seed;
+    double* cdf = locality == LOC_ZIPF ? build_zipf_cdf(working_set, alpha) : NULL;
+
+    proc_state procs[NUM_PROCS];
+    for (int p = 0; p < NUM_PROCS; p++) {
+        procs[p].slot_vpn = (uint32_t*)malloc(working_set * sizeof(uint32_t));
+        procs[p].in_use = (uint8_t*)calloc(num_pages, 1);
+        procs[p].cursor = 0;
+        if (!procs[p].slot_vpn || !procs[p].in_use) {
+            perror("malloc");
+            return 1;
+        }
+    }
+
+    fprintf(out, "%% tracegen n=%llu seed=%llu wset=%u locality=%s alpha=%g ctxswitch=%u churn=%u\n",
+            (unsigned long long)num_instructions, (unsigned long long)seed, working_set,
+            locality == LOC_ZIPF ? "zipf" : locality == LOC_SEQ ? "seq" : "random",
+            alpha, ctxswitch_period, churn);
+
+    uint64_t emitted = 0;
+#define EMIT(...) do { if (emitted == num_instructions) goto done; \
+                       fprintf(out, __VA_ARGS__); emitted++; } while (0)
+
+    EMIT("define %d %d %d\n", off_bits, pfn_bits, vpn_bits);
+
+    // Map the initial working set of every process (spread over the VPN space)
+    for (int p = NUM_PROCS - 1; p >= 0; p--) {
+        EMIT("ctxswitch %d\n", p);
+        for (uint32_t s = 0; s < working_set; s++) {
+            uint32_t vpn = (uint32_t)(((uint64_t)s * num_pages) / working_set);
+            procs[p].slot_vpn[s] = vpn;
+            procs[p].in_use[vpn] = 1;
+            EMIT("map %u %u\n", vpn, rng_below(num_frames));
+        }
+    }
+
+    int pid = 0;
+    while (emitted < num_instructions) {
+        proc_state* ps = &procs[pid];
+
+        if (ctxswitch_period > 0 && rng_below(ctxswitch_period) == 0) {
+            pid = (pid + 1 + (int)rng_below(NUM_PROCS - 1)) % NUM_PROCS;
+            EMIT("ctxswitch %d\n", pid);
+            continue;
+        }
+
+        if (churn > 0 && rng_below(1000) < churn) {
+            // Replace one working-set page with a fresh one (or remap in place when full)
+            uint32_t s = rng_below(working_set);
+            uint32_t old_vpn = ps->slot_vpn[s];
+            uint32_t new_vpn = old_vpn;
+            if (working_set < num_pages) {
+                do {
+                    new_vpn = rng_below(num_pages);
+                } while (ps->in_use[new_vpn]);
+            }
+            EMIT("unmap %u\n", old_vpn);
+            ps->in_use[old_vpn] = 0;
+            ps->in_use[new_vpn] = 1;
+            ps->slot_vpn[s] = new_vpn;
+            EMIT("map %u %u\n", new_vpn, rng_below(num_frames));
+            continue;
+        }
+
+        uint32_t slot, offset;
+        if (locality == LOC_ZIPF) {
+            slot = zipf_sample(cdf, working_set);
+            offset = rng_below(page_words);
+        } else if (locality == LOC_SEQ) {
+            slot = (uint32_t)((ps->cursor / page_words) % working_set);
+            offset = (uint32_t)(ps->cursor % page_words);
+            ps->cursor++;
+        } else {
+            slot = rng_below(working_set);
+            offset = rng_below(page_words);
+        }
+        uint32_t va = (ps->slot_vpn[slot] << off_bits) | offset;
+
+        uint32_t kind = rng_below(20);
+        if (kind < 9) {
+            EMIT("load r%u %u\n", 1 + (kind & 1), va);
+        } else if (kind < 18) {
+            if (kind & 1) {
+                EMIT("store %u r%u\n", va, 1 + ((kind >> 1) & 1));
+            } else {
+                EMIT("store %u #%u\n", va, rng_below(1000000));
+            }
+        } else {
+            EMIT("add\n");
+        }
+    }
+#undef EMIT
+
+done:
+    if (out != stdout) {
+        fclose(out);
+    } else {
+        fflush(out);
+    }
+
+    free(cdf);
+    for (int p = 0; p < NUM_PROCS; p++) {
+        free(procs[p].slot_vpn);
+        free(procs[p].in_use);
+    }
+    return 0;
+}
@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+#include "mathutil.h"
+
+/* Synthetic workload generator for mathserver.
+ *
+ * Writes a reproducible trace (same seed and parameters => same bytes) of
+ * exactly -n op lines spread over -c contexts. Context choice follows a
+ * Zipf distribution with exponent -k (0 = uniform). Cheap arithmetic
+ * operands are drawn from 1..-V, uniformly or log-uniformly (-D). The
+ * per-mille weights -f/-p/-r select fib, pia and pri. pia and pri use the
+ * context value as their size, so each is emitted as "set" to -P or -R
+ * followed by the op, and the pair counts as two ops. */
+
+enum { DIST_UNIFORM, DIST_LOG };
+
+static uint64_t rng_state;
+
+/* Cumulative distribution over context ranks for Zipf sampling */
+static double *build_zipf_cdf(uint32_t n, double alpha) {
+    double *cdf = malloc(n * sizeof(double));
+    if (!cdf) {
+        perror("malloc");
+        exit(1);
+    }
+    double total = 0.0;
+    for (uint32_t i = 0; i < n; i++) {
+        total += 1.0 / pow((double)(i + 1), alpha);
+        cdf[i] = total;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        cdf[i] /= total;
+    }
+    return cdf;
+}
+
+static uint32_t zipf_sample(const double *cdf, uint32_t n) {
+    double u = rng_unit(&rng_state);
+    uint32_t lo = 0, hi = n - 1;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (cdf[mid] < u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Operand in 1..max; never 0, so div is always safe */
+static int operand(int dist, uint32_t max) {
+    if (dist == DIST_LOG) {
+        uint32_t v = (uint32_t)exp(rng_unit(&rng_state) * log((double)max + 1.0));
+        return (int)(v < 1 ? 1 : v > max ? max : v);
+    }
+    return 1 + (int)rng_below(&rng_state, max);
+}
+
+int main(int argc, char *argv[]) {
+    const char usage[] =
+        "Usage: mathgen.out [-n ops] [-s seed] [-c contexts] [-k context skew]\n"
+        "                   [-f fib per mille] [-p pia per mille] [-r pri per mille]\n"
+        "                   [-V max operand] [-D uniform|log] [-P pia iterations]\n"
+        "                   [-R pri limit] [-o output trace]\n";
+    uint64_t num_ops = 1000000;
+    uint64_t seed = 1;
+    uint32_t num_contexts = 64;
+    double skew = 0.0;
+    uint32_t fib_weight = 0, pia_weight = 0, pri_weight = 0;
+    uint32_t max_operand = 100;
+    int dist = DIST_UNIFORM;
+    int pia_iterations = 100000;
+    int pri_limit = 100000;
+    const char *output_trace = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:c:k:f:p:r:V:D:P:R:o:")) != -1) {
+        switch (opt) {
+        case 'n': num_ops = strtoull(optarg, NULL, 10); break;
+        case 's': seed = strtoull(optarg, NULL, 10); break;
+        case 'c': num_contexts = (uint32_t)strtoul(optarg, NULL, 10); break;
+        case 'k': skew = atof(optarg); break;
+        case 'f': fib_weight = (uint32_t)strtoul(optarg, NULL, 10); break;
+        case 'p': pia_weight = (uint32_t)strtoul(optarg, NULL, 10); break;
+        case 'r': pri_weight = (uint32_t)strtoul(optarg, NULL, 10); break;
+        case 'V': max_operand = (uint32_t)strtoul(optarg, NULL, 10); break;
+        case 'D':
+            if (strcmp(optarg, "uniform") == 0) {
+                dist = DIST_UNIFORM;
+            } else if (strcmp(optarg, "log") == 0) {
+                dist = DIST_LOG;
+            } else {
+                printf("Unknown distribution %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'P': pia_iterations = atoi(optarg); break;
+        case 'R': pri_limit = atoi(optarg); break;
+        case 'o': output_trace = optarg; break;
+        default:
+            printf("%s", usage);
+            return 1;
+        }
+    }
+    if (optind != argc || num_contexts == 0 || max_operand == 0 || max_operand > INT32_MAX ||
+        fib_weight + pia_weight + pri_weight > 1000 || skew < 0.0) {
+        printf("%s", usage);
+        return 1;
+    }
+
+    FILE *out = stdout;
+    if (output_trace) {
+        out = fopen(output_trace, "w");
+        if (!out) {
+            perror("Error opening output file");
+            return 1;
+        }
+    }
+    static char out_buffer[1 << 20];
+    setvbuf(out, out_buffer, _IOFBF, sizeof(out_buffer));
+
+    rng_state = seed;
+    double *cdf = skew > 0.0 ? build_zipf_cdf(num_contexts, skew) : NULL;
+
+    /* not an instruction, so mathserver skips it */
+    fprintf(out, "# mathgen n=%llu seed=%llu contexts=%u skew=%g fib=%u pia=%u pri=%u "
+            "operand=%u dist=%s pia_n=%d pri_n=%d\n",
+            (unsigned long long)num_ops, (unsigned long long)seed, num_contexts, skew,
+            fib_weight, pia_weight, pri_weight, max_operand,
+            dist == DIST_LOG ? "log" : "uniform", pia_iterations, pri_limit);
+
+    static const char *const arith[] = { "set", "add", "sub", "mul", "div" };
+    uint64_t emitted = 0;
+    while (emitted < num_ops) {
+        uint32_t ctx = cdf ? zipf_sample(cdf, num_contexts) : rng_below(&rng_state, num_contexts);
+        uint32_t pick = rng_below(&rng_state, 1000);
+
+        if (pick < fib_weight) {
+            fprintf(out, "fib %u\n", ctx);
+            emitted++;
+        } else if (pick < fib_weight + pia_weight && emitted + 2 <= num_ops) {
+            fprintf(out, "set %u %d\npia %u\n", ctx, pia_iterations, ctx);
+            emitted += 2;
+        } else if (pick < fib_weight + pia_weight + pri_weight && emitted + 2 <= num_ops) {
+            fprintf(out, "set %u %d\npri %u\n", ctx, pri_limit, ctx);
+            emitted += 2;
+        } else {
+            /* set keeps values from drifting far under long mul chains */
+            fprintf(out, "%s %u %d\n", arith[rng_below(&rng_state, 5)], ctx, operand(dist, max_operand));
+            emitted++;
+        }
+    }
+
+    if (out != stdout) {
+        fclose(out);
+    } else {
+        fflush(out);
+    }
+    free(cdf);
+    return 0;
+}
@@ -0,0 +1,327 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <pthread.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "mathutil.h"
+
+/* Load generator for mathserver's server mode (-l).
+ *
+ * Opens -c connections spread over -T threads. Each connection owns one
+ * context and keeps up to -P requests in flight for -d seconds. Because a
+ * context answers in request order, the n-th response on a connection
+ * belongs to its n-th request, and its latency is the time between the two.
+ * Reports requests/sec and latency percentiles. */
+
+#define READ_BYTES 65536
+
+typedef struct {
+    int fd;
+    int ctx;
+    uint64_t *sent_at;      /* ring of send times, one per request in flight */
+    long sent;
+    long received;
+    char *wbuf;             /* requests not yet written */
+    size_t wlen;
+    size_t wpos;
+    size_t wcap;
+    int want_out;
+    int done;
+} Conn;
+
+typedef struct {
+    pthread_t thread;
+    Conn *conns;
+    int num_conns;
+    uint64_t rng;
+    long requests;
+    uint64_t hist[HIST_BUCKETS];
+} LoadThread;
+
+static const char *server_addr = "127.0.0.1:7070";
+static int depth = 16;
+static int fib_per_mille = 0;
+static uint64_t deadline;
+
+/* Connect to "[host:]port" or a Unix socket path (anything with a '/') */
+static int connect_server(const char *addr) {
+    int fd;
+    if (strchr(addr, '/')) {
+        struct sockaddr_un sun;
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        strncpy(sun.sun_path, addr, sizeof(sun.sun_path) - 1);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0 || connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+            perror(addr);
+            exit(1);
+        }
+        return fd;
+    }
+
+    char host[256] = "127.0.0.1";
+    const char *port = strrchr(addr, ':');
+    if (port) {
+        size_t len = (size_t)(port - addr);
+        if (len > 0) {
+            if (len >= sizeof(host)) len = sizeof(host) - 1;
+            memcpy(host, addr, len);
+            host[len] = '\0';
+        }
+        port++;
+    } else {
+        port = addr;
+    }
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int rc = getaddrinfo(host, port, &hints, &res);
+    if (rc != 0) {
+        fprintf(stderr, "%s: %s\n", addr, gai_strerror(rc));
+        exit(1);
+    }
+    fd = -1;
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0) {
+        perror(addr);
+        exit(1);
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static void queue_request(LoadThread *t, Conn *c) {
+    if (c->wlen + 64 > c->wcap) {
+        c->wcap = c->wcap ? c->wcap * 2 : 4096;
+        c->wbuf = realloc(c->wbuf, c->wcap);
+        if (!c->wbuf) { perror("realloc"); exit(1); }
+    }
+    static const char *const arith[] = { "add", "sub", "mul", "div" };
+    char *p = c->wbuf + c->wlen;
+    int n;
+    uint64_t r = rng_next(&t->rng);
+    if (c->sent == 0) {
+        n = sprintf(p, "set %d %d\n", c->ctx, (int)(r % 1000));
+    } else if ((int)(r % 1000) < fib_per_mille) {
+        n = sprintf(p, "fib %d\n", c->ctx);
+    } else {
+        n = sprintf(p, "%s %d %d\n", arith[(r >> 10) & 3], c->ctx, 1 + (int)((r >> 12) % 100));
+    }
+    c->wlen += (size_t)n;
+    c->sent_at[c->sent % depth] = now_ns();
+    c->sent++;
+}
+
+/* Top up the pipeline and write what the socket takes */
+static void pump(LoadThread *t, Conn *c, uint64_t now) {
+    if (now < deadline) {
+        while (c->sent - c->received < depth) {
+            queue_request(t, c);
+        }
+    }
+    while (c->wpos < c->wlen) {
+        ssize_t n = send(c->fd, c->wbuf + c->wpos, c->wlen - c->wpos, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            perror("send");
+            exit(1);
+        }
+        c->wpos += (size_t)n;
+    }
+    if (c->wpos == c->wlen) {
+        c->wpos = c->wlen = 0;
+    }
+}
+
+static void *load_main(void *arg) {
+    LoadThread *t = arg;
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    for (int i = 0; i < t->num_conns; i++) {
+        Conn *c = &t->conns[i];
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->fd, &ev);
+        pump(t, c, now_ns());
+    }
+
+    int active = t->num_conns;
+    char *buf = malloc(READ_BYTES);
+    if (!buf) { perror("malloc"); exit(1); }
+    struct epoll_event events[64];
+    while (active > 0) {
+        uint64_t now = now_ns();
+        int timeout = now < deadline ? (int)((deadline - now) / 1000000) + 1 : 100;
+        int n = epoll_wait(epoll_fd, events, 64, timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            exit(1);
+        }
+        now = now_ns();
+        for (int i = 0; i < n; i++) {
+            Conn *c = events[i].data.ptr;
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                ssize_t len = read(c->fd, buf, READ_BYTES);
+                if (len <= 0) {
+                    if (len < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+                    fprintf(stderr, "Server closed connection for ctx %d\n", c->ctx);
+                    exit(1);
+                }
+                for (char *p = buf; (p = memchr(p, '\n', (size_t)(buf + len - p))) != NULL; p++) {
+                    uint64_t lat = now - c->sent_at[c->received % depth];
+                    t->hist[hist_bucket(lat)]++;
+                    c->received++;
+                }
+            }
+            pump(t, c, now);
+        }
+        /* the deadline has passed: retire connections as they drain */
+        for (int i = 0; i < t->num_conns; i++) {
+            Conn *c = &t->conns[i];
+            int want_out = c->wpos < c->wlen;
+            if (!c->done && now >= deadline && c->received == c->sent) {
+                c->done = 1;
+                active--;
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+            } else if (!c->done && want_out != c->want_out) {
+                struct epoll_event ev = { .events = EPOLLIN | (want_out ? EPOLLOUT : 0), .data.ptr = c };
+                epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+                c->want_out = want_out;
+            }
+        }
+    }
+
+    for (int i = 0; i < t->num_conns; i++) {
+        t->requests += t->conns[i].received;
+    }
+    free(buf);
+    close(epoll_fd);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    const char usage[] =
+        "Usage: mathload.out [-a [host:]port | unix socket path] [-c connections] [-T threads]\n"
+        "                    [-P pipeline depth] [-d seconds] [-f fib per mille] [-b first ctx]\n"
+        "                    [-s seed]\n";
+    int num_conns = 8;
+    int num_threads = 1;
+    double seconds = 5.0;
+    int first_ctx = 0;
+    uint64_t seed = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "a:c:T:P:d:f:b:s:")) != -1) {
+        switch (opt) {
+        case 'a': server_addr = optarg; break;
+        case 'c': num_conns = atoi(optarg); break;
+        case 'T': num_threads = atoi(optarg); break;
+        case 'P': depth = atoi(optarg); break;
+        case 'd': seconds = atof(optarg); break;
+        case 'f': fib_per_mille = atoi(optarg); break;
+        case 'b': first_ctx = atoi(optarg); break;
+        case 's': seed = strtoull(optarg, NULL, 10); break;
+        default:
+            printf("%s", usage);
+            return 1;
+        }
+    }
+    if (optind != argc || num_conns < 1 || num_threads < 1 || depth < 1 || seconds <= 0.0) {
+        printf("%s", usage);
+        return 1;
+    }
+    if (num_threads > num_conns) {
+        num_threads = num_conns;
+    }
+
+    Conn *conns = calloc((size_t)num_conns, sizeof(Conn));
+    LoadThread *threads = calloc((size_t)num_threads, sizeof(LoadThread));
+    if (!conns || !threads) {
+        perror("calloc");
+        return 1;
+    }
+    for (int i = 0; i < num_conns; i++) {
+        conns[i].fd = connect_server(server_addr);
+        fcntl(conns[i].fd, F_SETFL, fcntl(conns[i].fd, F_GETFL) | O_NONBLOCK);
+        conns[i].ctx = first_ctx + i;
+        conns[i].sent_at = calloc((size_t)depth, sizeof(uint64_t));
+        if (!conns[i].sent_at) {
+            perror("calloc");
+            return 1;
+        }
+    }
+
+    uint64_t start = now_ns();
+    deadline = start + (uint64_t)(seconds * 1e9);
+    int next = 0;
+    for (int i = 0; i < num_threads; i++) {
+        LoadThread *t = &threads[i];
+        t->conns = &conns[next];
+        t->num_conns = num_conns / num_threads + (i < num_conns % num_threads);
+        t->rng = seed + (uint64_t)i;
+        next += t->num_conns;
+        if (pthread_create(&t->thread, NULL, load_main, t) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    static uint64_t hist[HIST_BUCKETS];
+    long requests = 0;
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        requests += threads[i].requests;
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            hist[b] += threads[i].hist[b];
+        }
+    }
+    double elapsed = (double)(now_ns() - start) * 1e-9;
+
+    printf("%-12s %12s %10s %12s %10s %10s %10s %10s %10s\n", "connections", "requests", "seconds",
+           "req/s", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+    uint64_t max = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        if (hist[b]) max = hist_value(b);
+    }
+    if (requests > 0) {
+        printf("%-12d %12ld %10.3f %12.0f %10.1f %10.1f %10.1f %10.1f %10.1f\n", num_conns, requests,
+               elapsed, (double)requests / elapsed,
+               hist_percentile(hist, requests, 50.0) / 1e3, hist_percentile(hist, requests, 90.0) / 1e3,
+               hist_percentile(hist, requests, 99.0) / 1e3, hist_percentile(hist, requests, 99.9) / 1e3,
+               max / 1e3);
+    }
+
+    for (int i = 0; i < num_conns; i++) {
+        close(conns[i].fd);
+        free(conns[i].sent_at);
+        free(conns[i].wbuf);
+    }
+    free(conns);
+    free(threads);
+    return 0;
+}
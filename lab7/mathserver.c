@@ -1,325 +1,2453 @@
+#define _GNU_SOURCE     /* accept4 */
 #include <stdio.h>
 #include <pthread.h>
 #include <string.h>
 #include <stdlib.h>
-#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sched.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "mathutil.h"
 
+enum { OP_SET, OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_FIB, OP_PIA, OP_PRI, NUM_OPCODES };
+
+/* One decoded op; 8 bytes */
 typedef struct {
-    char *instruction;
-    int val;
+    int32_t val;
+    uint32_t opcode : 8;
+    uint32_t conn : 24;     /* server mode: connection that sent it */
 } Operation;
 
+#define OP_CHUNK_OPS 510        /* a chunk fills one 4 KB page */
+#define OP_CHUNK_SMALL_OPS 14   /* a list's first chunk: 128 bytes, enough for most contexts */
+
+typedef struct OpChunk OpChunk;
+struct OpChunk {
+    OpChunk *next;
+    unsigned count;         /* ops the consumer reads here; less when sealed early */
+    unsigned cap;           /* OP_CHUNK_SMALL_OPS or OP_CHUNK_OPS */
+    Operation ops[];
+};
+
+/* Bump allocator for op chunks, with a free list per chunk size */
+typedef struct Arena Arena;
+struct Arena {
+    char *block;
+    size_t used;
+    OpChunk *free_chunks;
+    OpChunk *free_small_chunks;
+    pthread_mutex_t lock;
+    void **blocks;
+    size_t num_blocks;
+};
+
+/* Unit of work for the worker pool; embedded as the first member of its owner */
+typedef struct Task Task;
+struct Task {
+    void (*run)(Task *task);
+    Task *next;             /* link in the injection queue */
+};
+
+#define ROB_LINE_BYTES 64
+
+/* Reorder buffer entry: one per log line, in program order */
+typedef struct {
+    char *line;             /* points at text, or a heap buffer for long lines */
+    size_t len;
+    atomic_int ready;
+    uint32_t conn;          /* server mode: where the line goes */
+    char text[ROB_LINE_BYTES];
+} RobSlot;
+
+#define ROB_SIZE 256
+/* Slots come in blocks allocated as the context first needs them, so a
+ * context with few ops in flight costs a block, not the whole buffer.
+ * Blocks never move: heavy ops hold pointers to their slots. */
+#define ROB_BLOCK_SLOTS 8
+#define ROB_BLOCKS (ROB_SIZE / ROB_BLOCK_SLOTS)
+
+/* Single-producer/single-consumer queue of op chunks. The parser produces;
+ * the worker currently running the context consumes. */
+typedef struct {
+    OpChunk *head_chunk;    /* consumer side */
+    unsigned head_pos;
+    OpChunk *tail_chunk;    /* producer side */
+    unsigned tail_pos;
+    int bounded;            /* streaming: producer waits for the consumer */
+    atomic_int producer_waiting;    /* producer is asleep on queue_space_cond */
+    atomic_ulong pushed;    /* ops published */
+    atomic_ulong popped;    /* ops consumed */
+    _Atomic(OpChunk *) spare;   /* a consumed chunk kept for the producer's reuse */
+    Arena *arena;
+} OpQueue;
+
 typedef struct {
+    Task task;              /* runs the next segment of this context's ops */
     int id;
     int value;
-    Operation *operations;
-    int op_size;
-    pthread_t thread;
+    OpQueue queue;
+    atomic_int scheduled;   /* task is queued, running or parked */
+    atomic_int closed;      /* no more ops will be queued */
+    int drained;            /* runner has seen the last op */
+    int deferred;           /* streaming: on the parser's list to schedule later */
+    RobSlot *rob[ROB_BLOCKS];   /* filled in by the runner before rob_tail passes them */
+    atomic_uint rob_head;   /* next slot to retire */
+    atomic_uint rob_tail;   /* next slot to fill */
+    atomic_flag retiring;   /* held while writing retired lines */
+    atomic_int parked;      /* segment stopped on a full reorder buffer */
+    atomic_long refs;       /* running segment + unretired slots */
+    char *det_out;          /* deterministic mode: everything retired so far */
+    size_t det_len;
+    size_t det_cap;
 } Context;
 
-#define NUM_CONTEXTS 16
-#define LOG_BATCH_SIZE 10
+enum { HEAVY_PIA, HEAVY_PRI };
 
-static Context contexts[NUM_CONTEXTS];
-static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
-static FILE *output_file = NULL;
+/* A read-only op dispatched to the pool with a snapshot of the context value */
+typedef struct {
+    Task task;
+    Context *ctx;
+    RobSlot *slot;
+    int kind;
+    int value;
+    uint64_t start_ns;      /* stats: when the op was dispatched */
+} HeavyOp;
 
-/* Helper to append formatted text to a dynamically growing buffer */
-static void appendf(char **buf, size_t *cap, size_t *len, const char *fmt, ...) {
-    va_list args;
-    while (1) {
-        if (*len + 1 >= *cap) {
-            *cap *= 2;
-            char *tmp = realloc(*buf, *cap);
-            if (!tmp) {
-                perror("realloc");
+/* One context's ops from one slice of the input, as a private chunk list */
+typedef struct {
+    int id;
+    OpChunk *first;
+    OpChunk *last;
+    unsigned last_pos;
+    unsigned long count;
+} ParseSegment;
+
+/* Parses a newline-aligned slice of the mapped input into per-context
+ * segments, kept in first-seen order for stitching */
+typedef struct {
+    Task task;
+    const char *begin;
+    const char *end;
+    Arena arena;
+    ParseSegment *segments;
+    size_t num_segments;
+    size_t segments_cap;
+    size_t *index;          /* open-addressed id -> segment number + 1 */
+    size_t index_cap;
+} ParseJob;
+
+typedef struct Connection Connection;
+
+/* A client of server mode. The event loop owns the socket and both byte
+ * buffers it reads and sends from; workers append retired responses to out
+ * under the lock. */
+struct Connection {
+    int fd;
+    uint32_t index;         /* in conn_table; carried by its ops */
+    int read_closed;        /* peer has finished sending requests */
+    uint32_t events;        /* registered with epoll */
+    char *in;               /* request bytes not yet parsed */
+    size_t in_len;
+    size_t in_cap;
+    char *send;             /* responses being written to the socket */
+    size_t send_len;
+    size_t send_pos;
+    size_t send_cap;
+    pthread_mutex_t lock;   /* guards the fields below */
+    char *out;              /* responses retired since the last swap */
+    size_t out_len;
+    size_t out_cap;
+    long pending;           /* requests whose response has not been retired */
+    int failed;             /* socket error: fd closed, responses dropped */
+    int queued;             /* on the ready list */
+    Connection *next_ready;
+};
+
+/* Growable ring for the Chase-Lev work-stealing deque */
+typedef struct DequeArray DequeArray;
+struct DequeArray {
+    long size;
+    DequeArray *retired;    /* older, smaller arrays kept alive for in-flight thieves */
+    _Atomic(Task *) buf[];
+};
+
+typedef struct {
+    atomic_long top;
+    atomic_long bottom;
+    _Atomic(DequeArray *) array;
+} Deque;
+
+/* A run of buffered bytes bound for one file offset */
+typedef struct {
+    off_t offset;
+    size_t start;           /* position in the buffer */
+    size_t len;
+} OutExtent;
+
+#define OUT_MAX_EXTENTS 1024
+
+/* Per-worker output buffer. File space is reserved when lines retire, so
+ * buffers flush independently and never need a lock. */
+typedef struct {
+    char *data;
+    size_t len;
+    OutExtent extents[OUT_MAX_EXTENTS];
+    int num_extents;
+} OutBuf;
+
+#define STATS_SAMPLE 16         /* time one in this many cheap ops; power of two */
+
+/* Per-worker instrumentation. Only the owning worker writes (plain relaxed
+ * load + store, no read-modify-write); the stats thread reads it at dump
+ * time without stopping anyone. */
+typedef struct {
+    _Atomic uint64_t ops;                           /* taken off context queues */
+    _Atomic uint64_t count[NUM_OPCODES];
+    _Atomic uint64_t latency_ns[NUM_OPCODES];       /* sum over timed ops, for the mean */
+    _Atomic uint64_t latency[NUM_OPCODES][HIST_BUCKETS];   /* timed ops only */
+    _Atomic uint64_t tasks;
+    _Atomic uint64_t steals;
+    _Atomic uint64_t busy_ns;
+} WorkerStats;
+
+typedef struct {
+    Deque deque;
+    pthread_t thread;
+    int index;
+    uint64_t rng;
+    OutBuf out;
+    WorkerStats *stats;     /* NULL unless -S */
+} Worker;
+
+#define OUT_BUFFER_BYTES (1 << 20)
+#define STREAM_QUEUE_OPS 2040   /* per-context bound in streaming mode (4 chunks) */
+#define STREAM_QUEUE_LOW (STREAM_QUEUE_OPS / 2)    /* wake a waiting producer at this depth */
+#define STREAM_SUBMIT_OPS STREAM_QUEUE_LOW     /* queued ops that make an idle context worth a wakeup */
+#define ARENA_BLOCK_BYTES (1 << 20)
+#define SEGMENT_OPS 1024        /* ops a context runs before yielding its worker */
+#define DEQUE_INITIAL_SIZE 64
+#define FIB_MEMO_SIZE 4096      /* power of two */
+#define SIEVE_SEGMENT_BYTES 32768
+#define SIEVE_SEGMENT_SPAN ((uint64_t)SIEVE_SEGMENT_BYTES * 16)    /* odd-only: 2 numbers per bit */
+#define PARSE_JOBS_PER_WORKER 4
+#define PARSE_SLICE_MIN_BYTES (1L << 20)
+#define READ_BUFFER_BYTES 65536
+#define SERVER_MAX_CONNECTIONS 65536    /* fits the 24-bit conn field */
+#define CONN_MAX_PENDING 4096   /* stop reading a client this far ahead of its responses */
+#define SERVER_EVENTS 64
+
+static int output_fd = -1;
+static atomic_llong output_offset = 0;  /* next free byte in the output file */
+static int output_seekable = 1; /* regular file: pwrite at reserved offsets */
+/* Pipes and terminals take retired lines through one shared buffer instead */
+static pthread_mutex_t stream_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char *stream_buf = NULL;
+static size_t stream_len = 0;
+static int deterministic = 0;   /* write each context's output contiguously, in id order */
+static int streaming = 0;       /* run ops while the input is still being parsed */
+static int serving = 0;         /* requests arrive on sockets; responses go back on them */
+static int stats_enabled = 0;   /* collect per-worker stats; dump at exit and on SIGUSR1 */
+static double stats_interval = 0.0;     /* seconds between periodic dumps; 0 = none */
+static Arena op_arena = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Context registry: open-addressed id -> context map plus insertion-ordered list */
+static Context **context_table = NULL;
+static size_t context_table_cap = 0;
+static Context **context_list = NULL;
+static size_t num_contexts = 0;
+static size_t context_list_cap = 0;
+
+/* Worker pool */
+static Worker *workers = NULL;
+static int num_workers = 0;
+static __thread Worker *self_worker = NULL;
+static pthread_mutex_t inject_mutex = PTHREAD_MUTEX_INITIALIZER;
+static Task *inject_head = NULL;
+static Task *inject_tail = NULL;
+static atomic_long inject_count = 0;
+static pthread_mutex_t sleep_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sleep_cond = PTHREAD_COND_INITIALIZER;
+static atomic_int sleepers = 0;
+static atomic_int pool_shutdown = 0;
+
+/* Batch completion */
+static atomic_long contexts_remaining = 0;
+static pthread_mutex_t done_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static atomic_long parse_jobs_remaining = 0;
+
+/* Stats */
+static uint64_t stats_start_ns = 0;
+static _Atomic uint64_t stats_submitted = 0;    /* ops queued; written by the parsing thread only */
+static pthread_t stats_thread;
+static atomic_int stats_stop = 0;
+
+/* Server mode */
+static Connection **conn_table = NULL;
+static uint32_t *conn_free_indices = NULL;
+static size_t conn_num_free = 0;
+static uint32_t *conn_retired_indices = NULL;  /* freed this event-loop round */
+static size_t conn_num_retired = 0;
+static uint32_t conn_next_index = 0;
+static pthread_mutex_t ready_mutex = PTHREAD_MUTEX_INITIALIZER;
+static Connection *ready_head = NULL;   /* connections with responses to send */
+static int server_event_fd = -1;        /* wakes the event loop for ready_head */
+static volatile sig_atomic_t server_stop = 0;
+
+/* A chunk of cap ops, either OP_CHUNK_SMALL_OPS or OP_CHUNK_OPS */
+static OpChunk *arena_alloc_chunk(Arena *a, unsigned cap) {
+    size_t size = sizeof(OpChunk) + cap * sizeof(Operation);
+    OpChunk **free_list = cap == OP_CHUNK_OPS ? &a->free_chunks : &a->free_small_chunks;
+    pthread_mutex_lock(&a->lock);
+    OpChunk *c = *free_list;
+    if (c) {
+        *free_list = c->next;
+    } else {
+        if (!a->block || a->used + size > ARENA_BLOCK_BYTES) {
+            void **blocks = realloc(a->blocks, (a->num_blocks + 1) * sizeof(void *));
+            a->block = malloc(ARENA_BLOCK_BYTES);
+            if (!blocks || !a->block) {
+                perror("malloc arena");
                 exit(1);
             }
-            *buf = tmp;
+            a->blocks = blocks;
+            a->blocks[a->num_blocks++] = a->block;
+            a->used = 0;
         }
-        va_start(args, fmt);
-        int written = vsnprintf(*buf + *len, *cap - *len, fmt, args);
-        va_end(args);
-        if (written < 0) {
-            perror("vsnprintf");
-            exit(1);
+        c = (OpChunk *)(a->block + a->used);
+        a->used += size;
+    }
+    pthread_mutex_unlock(&a->lock);
+    c->next = NULL;
+    c->count = cap;
+    c->cap = cap;
+    return c;
+}
+
+static void arena_free_chunk(Arena *a, OpChunk *c) {
+    OpChunk **free_list = c->cap == OP_CHUNK_OPS ? &a->free_chunks : &a->free_small_chunks;
+    pthread_mutex_lock(&a->lock);
+    c->next = *free_list;
+    *free_list = c;
+    pthread_mutex_unlock(&a->lock);
+}
+
+static void arena_destroy(Arena *a) {
+    for (size_t i = 0; i < a->num_blocks; i++) {
+        free(a->blocks[i]);
+    }
+    free(a->blocks);
+    pthread_mutex_destroy(&a->lock);
+    memset(a, 0, sizeof(*a));
+}
+
+/* A producer blocked on a full bounded queue sleeps here; the one parser
+ * thread is the only producer, so one condition variable serves every queue */
+static pthread_mutex_t queue_space_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_space_cond = PTHREAD_COND_INITIALIZER;
+
+static void op_queue_init(OpQueue *q, Arena *arena, int bounded) {
+    memset(q, 0, sizeof(*q));
+    q->arena = arena;
+    q->bounded = bounded;
+    atomic_init(&q->pushed, 0);
+    atomic_init(&q->popped, 0);
+    atomic_init(&q->producer_waiting, 0);
+    atomic_init(&q->spare, NULL);
+}
+
+/* Add operation to context queue. A bounded queue sleeps while the consumer
+ * is STREAM_QUEUE_OPS behind, until it drains to STREAM_QUEUE_LOW. */
+static void op_queue_push(OpQueue *q, Operation op) {
+    unsigned long pushed = atomic_load_explicit(&q->pushed, memory_order_relaxed);
+    if (q->bounded) {
+        while (pushed - atomic_load_explicit(&q->popped, memory_order_acquire) >= STREAM_QUEUE_OPS) {
+            pthread_mutex_lock(&queue_space_mutex);
+            /* flag first, then recheck: a pop that misses the flag is seen here */
+            atomic_store(&q->producer_waiting, 1);
+            if (pushed - atomic_load(&q->popped) >= STREAM_QUEUE_OPS) {
+                pthread_cond_wait(&queue_space_cond, &queue_space_mutex);
+            }
+            atomic_store_explicit(&q->producer_waiting, 0, memory_order_relaxed);
+            pthread_mutex_unlock(&queue_space_mutex);
         }
-        if ((size_t)written < *cap - *len) {
-            *len += (size_t)written;
-            break;
+    }
+    if (!q->tail_chunk || q->tail_pos == q->tail_chunk->cap) {
+        /* start small; a context that fills its first chunk gets full ones */
+        OpChunk *c = q->tail_chunk ?
+            atomic_exchange_explicit(&q->spare, NULL, memory_order_acquire) : NULL;
+        if (c) {
+            c->next = NULL;
+            c->count = OP_CHUNK_OPS;
+        } else {
+            c = arena_alloc_chunk(q->arena, q->tail_chunk ? OP_CHUNK_OPS : OP_CHUNK_SMALL_OPS);
         }
-        /* not enough space, grow and retry */
-        *cap += (size_t)written + 16;
-        char *tmp = realloc(*buf, *cap);
-        if (!tmp) {
-            perror("realloc");
-            exit(1);
+        /* linked before the op inside it is published */
+        if (q->tail_chunk) {
+            q->tail_chunk->next = c;
+        } else {
+            q->head_chunk = c;
+        }
+        q->tail_chunk = c;
+        q->tail_pos = 0;
+    }
+    q->tail_chunk->ops[q->tail_pos++] = op;
+    atomic_store(&q->pushed, pushed + 1);
+}
+
+/* Next op for the consumer, or 0 when the queue is empty */
+static int op_queue_pop(OpQueue *q, Operation *op) {
+    unsigned long popped = atomic_load_explicit(&q->popped, memory_order_relaxed);
+    if (popped == atomic_load_explicit(&q->pushed, memory_order_acquire)) {
+        return 0;
+    }
+    if (q->head_pos == q->head_chunk->count) {
+        OpChunk *done = q->head_chunk;
+        q->head_chunk = done->next;
+        q->head_pos = 0;
+        /* only full-size chunks are worth keeping for the producer */
+        if (done->cap == OP_CHUNK_OPS) {
+            done = atomic_exchange_explicit(&q->spare, done, memory_order_release);
         }
-        *buf = tmp;
+        if (done) {
+            arena_free_chunk(q->arena, done);
+        }
+    }
+    *op = q->head_chunk->ops[q->head_pos++];
+    /* the producer may count this op's space as free again */
+    if (!q->bounded) {
+        atomic_store_explicit(&q->popped, popped + 1, memory_order_release);
+        return 1;
+    }
+    /* store, then check the flag: pairs with the producer's flag-then-recheck */
+    atomic_store(&q->popped, popped + 1);
+    if (atomic_load(&q->producer_waiting) &&
+        atomic_load_explicit(&q->pushed, memory_order_relaxed) - (popped + 1) <= STREAM_QUEUE_LOW) {
+        pthread_mutex_lock(&queue_space_mutex);
+        pthread_cond_signal(&queue_space_cond);
+        pthread_mutex_unlock(&queue_space_mutex);
+    }
+    return 1;
+}
+
+/* Link a run of chunks parsed elsewhere onto the queue. The current tail
+ * chunk is sealed at its fill level. Only used before the context runs. */
+static void op_queue_append(OpQueue *q, OpChunk *first, OpChunk *last, unsigned last_pos,
+                            unsigned long n) {
+    if (q->tail_chunk) {
+        q->tail_chunk->count = q->tail_pos;
+        q->tail_chunk->next = first;
+    } else {
+        q->head_chunk = first;
     }
+    q->tail_chunk = last;
+    q->tail_pos = last_pos;
+    atomic_store(&q->pushed, atomic_load_explicit(&q->pushed, memory_order_relaxed) + n);
+}
+
+static int op_queue_empty(OpQueue *q) {
+    return atomic_load(&q->popped) == atomic_load(&q->pushed);
 }
 
-/* Tokenize a line into at most 3 tokens */
-static char **tokenize(char *input) {
-    static char *command[3];
-    for (int i = 0; i < 3; i++) {
-        command[i] = NULL;
+/* Instruction name -> opcode, or -1 for anything we do not execute */
+static int decode_opcode(const char *name, size_t len) {
+    if (len != 3) {
+        return -1;
     }
-    char *token = strtok(input, " ");
-    int i = 0;
-    while (token != NULL && i < 3) {
-        command[i++] = token;
-        token = strtok(NULL, " ");
+    switch (name[0]) {
+    case 's':
+        if (name[1] == 'e' && name[2] == 't') return OP_SET;
+        if (name[1] == 'u' && name[2] == 'b') return OP_SUB;
+        break;
+    case 'a':
+        if (name[1] == 'd' && name[2] == 'd') return OP_ADD;
+        break;
+    case 'm':
+        if (name[1] == 'u' && name[2] == 'l') return OP_MUL;
+        break;
+    case 'd':
+        if (name[1] == 'i' && name[2] == 'v') return OP_DIV;
+        break;
+    case 'f':
+        if (name[1] == 'i' && name[2] == 'b') return OP_FIB;
+        break;
+    case 'p':
+        if (name[1] == 'i' && name[2] == 'a') return OP_PIA;
+        if (name[1] == 'r' && name[2] == 'i') return OP_PRI;
+        break;
     }
-    return command;
+    return -1;
 }
 
-/* Add operation to context queue */
-static void add_operation(Context *ctx, Operation op) {
-    int new_size = ctx->op_size + 1;
-    Operation *new_ops = realloc(ctx->operations, new_size * sizeof(Operation));
-    if (!new_ops) {
-        perror("realloc operations");
-        exit(1);
+/* atoi over [p, end): leading whitespace, optional sign, digits. Saturates
+ * like strtol before narrowing, so results match the old atoi parse. */
+static int parse_int(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || (*p >= '\t' && *p <= '\r'))) p++;
+    int neg = 0;
+    if (p < end && (*p == '-' || *p == '+')) {
+        neg = *p++ == '-';
     }
-    ctx->operations = new_ops;
-    ctx->operations[new_size - 1] = op;
-    ctx->op_size = new_size;
-}
-
-/* Slow recursive Fibonacci as requested */
-static int fib_recursive(int n) {
-    if (n <= 1) return n;
-    return fib_recursive(n - 1) + fib_recursive(n - 2);
-}
-
-static void *run_ops(void *arg) {
-    Context *ctx = (Context *)arg;
-    char *log_batch[LOG_BATCH_SIZE];
-    int batch_count = 0;
-
-    for (int i = 0; i < ctx->op_size; i++) {
-        Operation *op = &ctx->operations[i];
-        char *log_line = NULL;
-
-        if (strcmp(op->instruction, "set") == 0) {
-            ctx->value = op->val;
-            log_line = malloc(64);
-            if (!log_line) { perror("malloc"); exit(1); }
-            snprintf(log_line, 64, "ctx %02d: set to value %d\n", ctx->id, ctx->value);
-        } else if (strcmp(op->instruction, "add") == 0) {
-            ctx->value += op->val;
-            log_line = malloc(64);
-            if (!log_line) { perror("malloc"); exit(1); }
-            snprintf(log_line, 64, "ctx %02d: add %d (result: %d)\n", ctx->id, op->val, ctx->value);
-        } else if (strcmp(op->instruction, "sub") == 0) {
-            ctx->value -= op->val;
-            log_line = malloc(64);
-            if (!log_line) { perror("malloc"); exit(1); }
-            snprintf(log_line, 64, "ctx %02d: sub %d (result: %d)\n", ctx->id, op->val, ctx->value);
-        } else if (strcmp(op->instruction, "mul") == 0) {
-            ctx->value *= op->val;
-            log_line = malloc(64);
-            if (!log_line) { perror("malloc"); exit(1); }
-            snprintf(log_line, 64, "ctx %02d: mul %d (result: %d)\n", ctx->id, op->val, ctx->value);
-        } else if (strcmp(op->instruction, "div") == 0) {
-            /* assume well-formed input; no division by zero */
-            ctx->value /= op->val;
-            log_line = malloc(64);
-            if (!log_line) { perror("malloc"); exit(1); }
-            snprintf(log_line, 64, "ctx %02d: div %d (result: %d)\n", ctx->id, op->val, ctx->value);
-        } else if (strcmp(op->instruction, "fib") == 0) {
-            int n = ctx->value;
-            if (n < 0) n = 0;
-            int f = fib_recursive(n);
-            log_line = malloc(64);
-            if (!log_line) { perror("malloc"); exit(1); }
-            snprintf(log_line, 64, "ctx %02d: fib (result: %d)\n", ctx->id, f);
-        } else if (strcmp(op->instruction, "pia") == 0) {
-            int iterations = ctx->value;
-            if (iterations < 0) iterations = 0;
-            double sum = 0.0;
-            for (int k = 0; k < iterations; k++) {
-                double term = ((k % 2) == 0 ? 1.0 : -1.0) / (2.0 * k + 1.0);
-                sum += term;
+    unsigned long limit = (unsigned long)LONG_MAX + (unsigned long)neg;
+    unsigned long v = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        unsigned d = (unsigned)(*p++ - '0');
+        v = v > (limit - d) / 10 ? limit : v * 10 + d;
+    }
+    return (int)(neg ? (long)(0 - v) : (long)v);
+}
+
+/* Parse "<instr> <ctx> [<val>]" from the line [p, end), without its newline.
+ * Tokens are split on runs of spaces and anything past the third is ignored.
+ * Returns 0 for lines that queue nothing: blank, too short, negative context
+ * or an instruction we do not execute. */
+static int parse_line(const char *p, const char *end, int *ctx_id, Operation *op) {
+    const char *tok[3];
+    const char *tok_end[3];
+    int n = 0;
+    while (n < 3) {
+        while (p < end && *p == ' ') p++;
+        if (p == end) break;
+        tok[n] = p;
+        while (p < end && *p != ' ') p++;
+        tok_end[n++] = p;
+    }
+    if (n < 2) {
+        return 0;
+    }
+
+    int id = parse_int(tok[1], tok_end[1]);
+    if (id < 0) {
+        return 0;
+    }
+    int opcode = decode_opcode(tok[0], (size_t)(tok_end[0] - tok[0]));
+    if (opcode < 0) {
+        return 0;
+    }
+
+    *ctx_id = id;
+    op->opcode = (uint8_t)opcode;
+    op->conn = 0;
+    op->val = n == 3 ? parse_int(tok[2], tok_end[2]) : 0;
+    return 1;
+}
+
+/* Fast-doubling Fibonacci in O(log n). Arithmetic is mod 2^32, which is
+ * exactly what the old int recursion produced once it wrapped, so results
+ * are unchanged for every n. */
+static uint32_t fib_doubling(uint32_t n) {
+    uint32_t a = 0, b = 1;      /* F(k), F(k+1) */
+    for (int bit = 31; bit >= 0; bit--) {
+        uint32_t c = a * (2 * b - a);   /* F(2k) */
+        uint32_t d = a * a + b * b;     /* F(2k+1) */
+        if ((n >> bit) & 1) {
+            a = d;
+            b = c + d;
+        } else {
+            a = c;
+            b = d;
+        }
+    }
+    return a;
+}
+
+/* Results shared by every worker. Each entry packs (n + 1) << 32 | F(n) in
+ * one atomic word, so lookups and fills need no lock and never tear. */
+static _Atomic uint64_t fib_memo[FIB_MEMO_SIZE];
+
+/* Append-only buffer read without a lock. Growing copies it into a bigger
+ * block; older blocks stay on the retired chain for readers still holding
+ * them, and agree with the new one on everything published so far. */
+typedef struct SharedBlock SharedBlock;
+struct SharedBlock {
+    SharedBlock *retired;
+    size_t cap;
+    char data[];
+};
+
+/* Shared prime list, sized from the largest limit sieved so far */
+static _Atomic(SharedBlock *) prime_list = NULL;
+static atomic_long prime_count = 0;
+static _Atomic uint64_t sieve_next = 0;     /* every prime below this is listed */
+static pthread_mutex_t sieve_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Formatted ", p" text for the first prime_text_count primes */
+static _Atomic(SharedBlock *) prime_text = NULL;
+static atomic_long prime_text_count = 0;
+static pthread_mutex_t prime_text_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int fib_fast(int n) {
+    if (n <= 0) return 0;
+    _Atomic uint64_t *entry = &fib_memo[((uint32_t)n * 2654435761u) & (FIB_MEMO_SIZE - 1)];
+    uint64_t e = atomic_load_explicit(entry, memory_order_relaxed);
+    if ((e >> 32) == (uint64_t)n + 1) {
+        return (int)(uint32_t)e;
+    }
+    uint32_t f = fib_doubling((uint32_t)n);
+    atomic_store_explicit(entry, ((uint64_t)n + 1) << 32 | f, memory_order_relaxed);
+    return (int)f;
+}
+
+/* Room for need bytes in *shared, keeping the first used; the caller
+ * serializes writers. Grows at least geometrically. */
+static char *shared_reserve(_Atomic(SharedBlock *) *shared, size_t used, size_t need) {
+    SharedBlock *b = atomic_load_explicit(shared, memory_order_relaxed);
+    if (b && b->cap >= need) {
+        return b->data;
+    }
+    size_t cap = b ? b->cap * 2 : 0;
+    if (cap < need) cap = need;
+    SharedBlock *bigger = malloc(sizeof(SharedBlock) + cap);
+    if (!bigger) { perror("malloc"); exit(1); }
+    bigger->cap = cap;
+    bigger->retired = b;
+    if (used) memcpy(bigger->data, b->data, used);
+    atomic_store_explicit(shared, bigger, memory_order_release);
+    return bigger->data;
+}
+
+/* Upper bound on the number of primes below x >= 2: pi(x) < 1.2551 x / ln x,
+ * and 1.2551 / ln 2 < 2 */
+static size_t prime_count_bound(uint64_t x) {
+    return (size_t)(2 * x / (uint64_t)(63 - __builtin_clzll(x))) + 1;
+}
+
+/* Shared segmented sieve of Eratosthenes. One bit per odd number, one
+ * L1-sized segment at a time. Primes are appended to a list that only
+ * grows, and every context reads its prefix.
+ *
+ * Sieve [lo, lo + SIEVE_SEGMENT_SPAN) into list; caller holds sieve_mutex */
+static void sieve_segment(uint32_t *list, uint64_t lo, long *count) {
+    static uint64_t bits[SIEVE_SEGMENT_BYTES / sizeof(uint64_t)];
+    const uint64_t hi = lo + SIEVE_SEGMENT_SPAN;
+    memset(bits, 0, sizeof(bits));
+
+    /* bit i stands for lo + 2i + 1 */
+    if (lo == 0) {
+        /* the first segment holds its own base primes */
+        bits[0] |= 1;                                   /* 1 is not prime */
+        list[(*count)++] = 2;
+        for (uint64_t i = 1; i < SIEVE_SEGMENT_SPAN / 2; i++) {
+            uint64_t p = 2 * i + 1;
+            if (p * p >= hi) break;
+            if (bits[i / 64] & (1ULL << (i % 64))) continue;
+            for (uint64_t j = (p * p) / 2; j < SIEVE_SEGMENT_SPAN / 2; j += p) {
+                bits[j / 64] |= 1ULL << (j % 64);
             }
-            double pi_approx = 4.0 * sum;
-            log_line = malloc(64);
-            if (!log_line) { perror("malloc"); exit(1); }
-            /* 15 digits after decimal point */
-            snprintf(log_line, 64, "ctx %02d: pia (result %.15f)\n", ctx->id, pi_approx);
-        } else if (strcmp(op->instruction, "pri") == 0) {
-            int limit = ctx->value;
-            if (limit < 2) {
-                /* still need a log line, with empty list */
-                size_t cap = 64;
-                size_t len = 0;
-                log_line = malloc(cap);
-                if (!log_line) { perror("malloc"); exit(1); }
-                appendf(&log_line, &cap, &len, "ctx %02d: primes (result:)", ctx->id);
-                appendf(&log_line, &cap, &len, "\n");
-            } else {
-                size_t cap = 256;
-                size_t len = 0;
-                log_line = malloc(cap);
-                if (!log_line) { perror("malloc"); exit(1); }
-                appendf(&log_line, &cap, &len, "ctx %02d: primes (result:", ctx->id);
-
-                int first = 1;
-                for (int p = 2; p <= limit; p++) {
-                    int is_prime = 1;
-                    for (int d = 2; d * d <= p; d++) {
-                        if (p % d == 0) {
-                            is_prime = 0;
-                            break;
-                        }
-                    }
-                    if (is_prime) {
-                        if (first) {
-                            appendf(&log_line, &cap, &len, " %d", p);
-                            first = 0;
-                        } else {
-                            appendf(&log_line, &cap, &len, ", %d", p);
-                        }
-                    }
-                }
-                appendf(&log_line, &cap, &len, ")\n");
+        }
+    } else {
+        for (long k = 1; k < *count; k++) {
+            uint64_t p = list[k];
+            if (p * p >= hi) break;
+            uint64_t start = (lo + p - 1) / p * p;
+            if (start < p * p) start = p * p;
+            if ((start & 1) == 0) start += p;
+            for (uint64_t j = (start - lo) / 2; j < SIEVE_SEGMENT_SPAN / 2; j += p) {
+                bits[j / 64] |= 1ULL << (j % 64);
             }
+        }
+    }
+
+    for (size_t w = 0; w < sizeof(bits) / sizeof(bits[0]); w++) {
+        uint64_t candidates = ~bits[w];
+        while (candidates) {
+            uint64_t i = w * 64 + (uint64_t)__builtin_ctzll(candidates);
+            candidates &= candidates - 1;
+            uint64_t n = lo + 2 * i + 1;
+            if (n > INT_MAX) return;
+            list[(*count)++] = (uint32_t)n;
+        }
+    }
+}
+
+/* Primes <= limit, as a prefix of the shared list; grows the sieve on demand */
+static const uint32_t *primes_upto(int limit, long *count_out) {
+    *count_out = 0;
+    if (limit < 2) return NULL;
+
+    if ((uint64_t)limit >= atomic_load_explicit(&sieve_next, memory_order_acquire)) {
+        pthread_mutex_lock(&sieve_mutex);
+        uint64_t next = atomic_load_explicit(&sieve_next, memory_order_relaxed);
+        long count = atomic_load_explicit(&prime_count, memory_order_relaxed);
+        uint32_t *list = NULL;
+        if ((uint64_t)limit >= next) {
+            /* room for every prime in the segments this limit needs */
+            uint64_t end = ((uint64_t)limit / SIEVE_SEGMENT_SPAN + 1) * SIEVE_SEGMENT_SPAN;
+            list = (uint32_t *)shared_reserve(&prime_list, (size_t)count * sizeof(uint32_t),
+                                              prime_count_bound(end) * sizeof(uint32_t));
+        }
+        while ((uint64_t)limit >= next) {
+            sieve_segment(list, next, &count);
+            next += SIEVE_SEGMENT_SPAN;
+            atomic_store_explicit(&prime_count, count, memory_order_release);
+            atomic_store_explicit(&sieve_next, next, memory_order_release);
+        }
+        pthread_mutex_unlock(&sieve_mutex);
+    }
+
+    /* upper bound of limit in the published prefix; the count is loaded
+     * first so the list holds at least that many */
+    long lo = 0, hi = atomic_load_explicit(&prime_count, memory_order_acquire);
+    const uint32_t *list = (const uint32_t *)atomic_load_explicit(&prime_list, memory_order_acquire)->data;
+    while (lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+        if (list[mid] <= (uint32_t)limit) {
+            lo = mid + 1;
         } else {
-            /* Unknown instruction; ignore */
+            hi = mid;
+        }
+    }
+    *count_out = lo;
+    return list;
+}
+
+/* pwrite at offset; on a non-seekable output the offset is ignored and the
+ * caller writes in offset order */
+static void write_fully(int fd, const char *data, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t n = output_seekable ? pwrite(fd, data, len, offset) : write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror(output_seekable ? "pwrite" : "write");
+            exit(1);
         }
+        data += n;
+        len -= (size_t)n;
+        offset += n;
+    }
+}
 
-       
-        free(op->instruction);
+static void out_flush(OutBuf *b) {
+    for (int i = 0; i < b->num_extents; i++) {
+        OutExtent *e = &b->extents[i];
+        write_fully(output_fd, b->data + e->start, e->len, e->offset);
+    }
+    b->len = 0;
+    b->num_extents = 0;
+}
 
-        if (log_line != NULL) {
-            log_batch[batch_count++] = log_line;
+/* Append to the shared stream buffer; caller holds stream_mutex */
+static void stream_write(const char *data, size_t len) {
+    if (len > OUT_BUFFER_BYTES - stream_len) {
+        write_fully(output_fd, stream_buf, stream_len, 0);
+        stream_len = 0;
+        if (len > OUT_BUFFER_BYTES) {
+            write_fully(output_fd, data, len, 0);
+            return;
         }
+    }
+    memcpy(stream_buf + stream_len, data, len);
+    stream_len += len;
+}
 
-        if (batch_count == LOG_BATCH_SIZE) {
-            pthread_mutex_lock(&log_mutex);
-            for (int j = 0; j < LOG_BATCH_SIZE; j++) {
-                fputs(log_batch[j], output_file);
-                free(log_batch[j]);
-            }
-            pthread_mutex_unlock(&log_mutex);
-            batch_count = 0;
+/* Buffer bytes for a file offset that the caller has already reserved */
+static void out_write(OutBuf *b, off_t offset, const char *data, size_t len) {
+    if (len > OUT_BUFFER_BYTES - b->len) {
+        out_flush(b);
+        if (len > OUT_BUFFER_BYTES) {
+            write_fully(output_fd, data, len, offset);
+            return;
+        }
+    }
+    OutExtent *e = b->num_extents > 0 ? &b->extents[b->num_extents - 1] : NULL;
+    if (e && e->offset + (off_t)e->len == offset) {
+        e->len += len;
+    } else {
+        if (b->num_extents == OUT_MAX_EXTENTS) {
+            out_flush(b);
+        }
+        e = &b->extents[b->num_extents++];
+        e->offset = offset;
+        e->start = b->len;
+        e->len = len;
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+/* Chase-Lev work-stealing deque: the owner pushes and takes at the bottom,
+ * thieves steal from the top. Only the owner grows the array. */
+static DequeArray *deque_array_new(long size) {
+    DequeArray *a = malloc(sizeof(DequeArray) + (size_t)size * sizeof(_Atomic(Task *)));
+    if (!a) { perror("malloc"); exit(1); }
+    a->size = size;
+    a->retired = NULL;
+    return a;
+}
+
+static void deque_init(Deque *d) {
+    atomic_init(&d->top, 0);
+    atomic_init(&d->bottom, 0);
+    atomic_init(&d->array, deque_array_new(DEQUE_INITIAL_SIZE));
+}
+
+static void deque_destroy(Deque *d) {
+    DequeArray *a = atomic_load_explicit(&d->array, memory_order_relaxed);
+    while (a) {
+        DequeArray *older = a->retired;
+        free(a);
+        a = older;
+    }
+}
+
+static void deque_push(Deque *d, Task *t) {
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    long top = atomic_load_explicit(&d->top, memory_order_acquire);
+    DequeArray *a = atomic_load_explicit(&d->array, memory_order_relaxed);
+    if (b - top > a->size - 1) {
+        DequeArray *bigger = deque_array_new(a->size * 2);
+        for (long i = top; i < b; i++) {
+            atomic_store_explicit(&bigger->buf[i & (bigger->size - 1)],
+                                  atomic_load_explicit(&a->buf[i & (a->size - 1)], memory_order_relaxed),
+                                  memory_order_relaxed);
         }
+        bigger->retired = a;
+        atomic_store_explicit(&d->array, bigger, memory_order_release);
+        a = bigger;
     }
+    atomic_store_explicit(&a->buf[b & (a->size - 1)], t, memory_order_relaxed);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_release);
+}
 
-    if (batch_count > 0) {
-        pthread_mutex_lock(&log_mutex);
-        for (int j = 0; j < batch_count; j++) {
-            fputs(log_batch[j], output_file);
-            free(log_batch[j]);
+static Task *deque_take(Deque *d) {
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    DequeArray *a = atomic_load_explicit(&d->array, memory_order_relaxed);
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long top = atomic_load_explicit(&d->top, memory_order_relaxed);
+    Task *t = NULL;
+    if (top <= b) {
+        t = atomic_load_explicit(&a->buf[b & (a->size - 1)], memory_order_relaxed);
+        if (top == b) {
+            /* last element: race against thieves */
+            if (!atomic_compare_exchange_strong_explicit(&d->top, &top, top + 1,
+                                                         memory_order_seq_cst, memory_order_relaxed)) {
+                t = NULL;
+            }
+            atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
         }
-        pthread_mutex_unlock(&log_mutex);
+    } else {
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
     }
+    return t;
+}
 
-    return NULL;
+static Task *deque_steal(Deque *d) {
+    long top = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if (top >= b) {
+        return NULL;
+    }
+    DequeArray *a = atomic_load_explicit(&d->array, memory_order_acquire);
+    Task *t = atomic_load_explicit(&a->buf[top & (a->size - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &top, top + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed)) {
+        return NULL;    /* lost the race; caller moves on to another victim */
+    }
+    return t;
 }
 
-int main(int argc, char *argv[]) {
-    const char usage[] = "Usage: mathserver.out <input trace> <output trace>\n";
-    char *input_trace;
-    char *output_trace;
-    char buffer[1024];
+static int deque_nonempty(Deque *d) {
+    return atomic_load_explicit(&d->bottom, memory_order_relaxed) >
+           atomic_load_explicit(&d->top, memory_order_relaxed);
+}
 
-    if (argc != 3) {
-        printf("%s", usage);
-        return 1;
+/* Bump a counter that has a single writer */
+static inline void stat_add(_Atomic uint64_t *counter, uint64_t v) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + v,
+                          memory_order_relaxed);
+}
+
+/* Add a timed op to the calling worker's histogram */
+static void stats_record(int opcode, uint64_t ns) {
+    WorkerStats *st = self_worker->stats;
+    stat_add(&st->latency_ns[opcode], ns);
+    stat_add(&st->latency[opcode][hist_bucket(ns)], 1);
+}
+
+/* Queue for tasks submitted from outside the pool (e.g. the parser) */
+static void inject_push(Task *t) {
+    t->next = NULL;
+    pthread_mutex_lock(&inject_mutex);
+    if (inject_tail) {
+        inject_tail->next = t;
+    } else {
+        inject_head = t;
     }
+    inject_tail = t;
+    atomic_fetch_add(&inject_count, 1);
+    pthread_mutex_unlock(&inject_mutex);
+}
 
-    input_trace = argv[1];
-    output_trace = argv[2];
+static Task *inject_pop(void) {
+    if (atomic_load_explicit(&inject_count, memory_order_relaxed) == 0) {
+        return NULL;
+    }
+    pthread_mutex_lock(&inject_mutex);
+    Task *t = inject_head;
+    if (t) {
+        inject_head = t->next;
+        if (!inject_head) inject_tail = NULL;
+        atomic_fetch_sub(&inject_count, 1);
+    }
+    pthread_mutex_unlock(&inject_mutex);
+    return t;
+}
 
-    FILE *input_file = fopen(input_trace, "r");
-    if (!input_file) {
-        perror("Error opening input file");
-        return 1;
+static int pool_has_work(void) {
+    if (atomic_load(&inject_count) > 0) return 1;
+    for (int i = 0; i < num_workers; i++) {
+        if (deque_nonempty(&workers[i].deque)) return 1;
     }
-    output_file = fopen(output_trace, "w");
-    if (!output_file) {
-        perror("Error opening output file");
-        fclose(input_file);
-        return 1;
+    return 0;
+}
+
+/* Make a task runnable: onto our own deque when called from a worker */
+static void pool_submit(Task *t) {
+    if (self_worker) {
+        deque_push(&self_worker->deque, t);
+    } else {
+        inject_push(t);
     }
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&sleepers, memory_order_relaxed) > 0) {
+        pthread_mutex_lock(&sleep_mutex);
+        pthread_cond_signal(&sleep_cond);
+        pthread_mutex_unlock(&sleep_mutex);
+    }
+}
 
-    /* Initialize contexts */
-    for (int i = 0; i < NUM_CONTEXTS; i++) {
-        contexts[i].id = i;
-        contexts[i].value = 0;
-        contexts[i].operations = NULL;
-        contexts[i].op_size = 0;
+static Task *find_task(Worker *w) {
+    Task *t = deque_take(&w->deque);
+    if (t) return t;
+    t = inject_pop();
+    if (t) return t;
+    for (int attempt = 0; attempt < 2 * num_workers; attempt++) {
+        /* xorshift64 for victim selection */
+        w->rng ^= w->rng << 13;
+        w->rng ^= w->rng >> 7;
+        w->rng ^= w->rng << 17;
+        int victim = (int)(w->rng % (uint64_t)num_workers);
+        if (victim == w->index) continue;
+        t = deque_steal(&workers[victim].deque);
+        if (t) {
+            if (w->stats) stat_add(&w->stats->steals, 1);
+            return t;
+        }
     }
+    return NULL;
+}
 
-    /* Read input and build operation queues */
+static void *worker_main(void *arg) {
+    Worker *w = (Worker *)arg;
+    self_worker = w;
     while (1) {
-        char *rez = fgets(buffer, sizeof(buffer), input_file);
-        if (!rez) break;
+        Task *t = find_task(w);
+        if (t) {
+            if (w->stats) {
+                uint64_t start = now_ns();
+                t->run(t);
+                stat_add(&w->stats->busy_ns, now_ns() - start);
+                stat_add(&w->stats->tasks, 1);
+            } else {
+                t->run(t);
+            }
+            continue;
+        }
+        pthread_mutex_lock(&sleep_mutex);
+        atomic_fetch_add(&sleepers, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load(&pool_shutdown)) {
+            atomic_fetch_sub(&sleepers, 1);
+            pthread_mutex_unlock(&sleep_mutex);
+            break;
+        }
+        if (!pool_has_work()) {
+            pthread_cond_wait(&sleep_cond, &sleep_mutex);
+        }
+        atomic_fetch_sub(&sleepers, 1);
+        pthread_mutex_unlock(&sleep_mutex);
+    }
+    out_flush(&w->out);
+    return NULL;
+}
+
+static const char *const opcode_names[NUM_OPCODES] = {
+    "set", "add", "sub", "mul", "div", "fib", "pia", "pri"
+};
+
+/* Print every worker's counters to stderr. Runs concurrently with the
+ * workers, so a dump taken mid-run is a near-consistent snapshot. */
+static void stats_dump(const char *when) {
+    static uint64_t hist[HIST_BUCKETS];
+    double elapsed = (double)(now_ns() - stats_start_ns) * 1e-9;
+    char report[8192];
+    size_t len = 0;
+#define REPORT(...) \
+    do { \
+        int n_ = snprintf(report + len, sizeof(report) - len, __VA_ARGS__); \
+        if (n_ > 0) len = len + (size_t)n_ < sizeof(report) ? len + (size_t)n_ : sizeof(report) - 1; \
+    } while (0)
+
+    REPORT("mathserver stats (%s, %.3f s)\n", when, elapsed);
+    REPORT("%-4s %12s %10s %10s %10s %10s %10s\n", "op", "count", "mean us", "p50 us", "p90 us",
+           "p99 us", "max us");
+    uint64_t popped = 0;
+    for (int w = 0; w < num_workers; w++) {
+        popped += atomic_load_explicit(&workers[w].stats->ops, memory_order_relaxed);
+    }
+    for (int op = 0; op < NUM_OPCODES; op++) {
+        uint64_t count = 0, sum = 0;
+        memset(hist, 0, sizeof(hist));
+        for (int w = 0; w < num_workers; w++) {
+            WorkerStats *st = workers[w].stats;
+            count += atomic_load_explicit(&st->count[op], memory_order_relaxed);
+            sum += atomic_load_explicit(&st->latency_ns[op], memory_order_relaxed);
+            for (int b = 0; b < HIST_BUCKETS; b++) {
+                hist[b] += atomic_load_explicit(&st->latency[op][b], memory_order_relaxed);
+            }
+        }
+        if (count == 0) continue;
 
-        /* Strip newline */
-        size_t len = strlen(buffer);
-        if (len > 0 && buffer[len - 1] == '\n') {
-            buffer[len - 1] = '\0';
+        /* cheap ops are sampled, so the mean and percentiles use the timed total */
+        uint64_t total = 0, max = 0;
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            total += hist[b];
+            if (hist[b]) max = hist_value(b);
         }
+        REPORT("%-4s %12llu %10.2f %10.2f %10.2f %10.2f %10.2f\n", opcode_names[op],
+               (unsigned long long)count, total ? (double)sum / (double)total * 1e-3 : 0.0,
+               hist_percentile(hist, total, 50.0) * 1e-3, hist_percentile(hist, total, 90.0) * 1e-3,
+               hist_percentile(hist, total, 99.0) * 1e-3, max * 1e-3);
+    }
 
-        char *line = buffer;
-        if (line[0] == '\0') continue;
+    long tasks_queued = atomic_load(&inject_count);
+    for (int w = 0; w < num_workers; w++) {
+        long n = atomic_load(&workers[w].deque.bottom) - atomic_load(&workers[w].deque.top);
+        if (n > 0) tasks_queued += n;
+    }
+    uint64_t submitted = atomic_load_explicit(&stats_submitted, memory_order_relaxed);
+    REPORT("queued ops %llu, queued tasks %ld\n",
+           (unsigned long long)(submitted > popped ? submitted - popped : 0), tasks_queued);
 
-        char **command = tokenize(line);
-        if (!command[0] || !command[1]) {
-            continue;
+    REPORT("%-6s %12s %10s %10s %10s %7s\n", "worker", "tasks", "steals", "busy s", "idle s", "busy %");
+    for (int w = 0; w < num_workers; w++) {
+        WorkerStats *st = workers[w].stats;
+        double busy = (double)atomic_load_explicit(&st->busy_ns, memory_order_relaxed) * 1e-9;
+        double idle = elapsed > busy ? elapsed - busy : 0.0;
+        REPORT("%-6d %12llu %10llu %10.3f %10.3f %7.1f\n", w,
+               (unsigned long long)atomic_load_explicit(&st->tasks, memory_order_relaxed),
+               (unsigned long long)atomic_load_explicit(&st->steals, memory_order_relaxed),
+               busy, idle, elapsed > 0.0 ? 100.0 * busy / elapsed : 0.0);
+    }
+#undef REPORT
+    /* one write so concurrent dumps and other output do not interleave */
+    if (write(STDERR_FILENO, report, len) < 0) {
+        perror("write stats");
+    }
+}
+
+/* Dumps on SIGUSR1 and every stats_interval seconds. main blocks SIGUSR1
+ * before any thread exists, so only this one ever takes it. */
+static void *stats_main(void *arg) {
+    (void)arg;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    struct timespec interval = {
+        .tv_sec = (time_t)stats_interval,
+        .tv_nsec = (long)((stats_interval - (double)(time_t)stats_interval) * 1e9),
+    };
+    while (1) {
+        int sig = stats_interval > 0.0 ? sigtimedwait(&set, NULL, &interval) : sigwaitinfo(&set, NULL);
+        if (atomic_load(&stats_stop)) break;
+        if (sig == SIGUSR1) {
+            stats_dump("signal");
+        } else if (sig < 0 && errno == EAGAIN) {
+            stats_dump("interval");
         }
+    }
+    return NULL;
+}
 
-        Operation op;
-        op.instruction = strdup(command[0]);
-        if (!op.instruction) {
-            perror("strdup");
+static void pool_start(int n) {
+    num_workers = n;
+    workers = calloc((size_t)n, sizeof(Worker));
+    if (!workers) { perror("calloc"); exit(1); }
+    for (int i = 0; i < n; i++) {
+        deque_init(&workers[i].deque);
+        workers[i].index = i;
+        workers[i].rng = 0x9E3779B97F4A7C15ULL * (uint64_t)(i + 1);
+        workers[i].out.data = malloc(OUT_BUFFER_BYTES);
+        if (!workers[i].out.data) { perror("malloc"); exit(1); }
+        if (stats_enabled) {
+            workers[i].stats = calloc(1, sizeof(WorkerStats));
+            if (!workers[i].stats) { perror("calloc"); exit(1); }
+        }
+    }
+    stats_start_ns = now_ns();
+    for (int i = 0; i < n; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+            perror("pthread_create");
             exit(1);
         }
+    }
+    if (stats_enabled && pthread_create(&stats_thread, NULL, stats_main, NULL) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+}
 
-        if (command[2]) {
-            op.val = atoi(command[2]);
-        } else {
-            op.val = 0;
-        }
+static void pool_stop(void) {
+    pthread_mutex_lock(&sleep_mutex);
+    atomic_store(&pool_shutdown, 1);
+    pthread_cond_broadcast(&sleep_cond);
+    pthread_mutex_unlock(&sleep_mutex);
+    for (int i = 0; i < num_workers; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    if (stats_enabled) {
+        atomic_store(&stats_stop, 1);
+        pthread_kill(stats_thread, SIGUSR1);
+        pthread_join(stats_thread, NULL);
+        stats_dump("exit");
+    }
+    for (int i = 0; i < num_workers; i++) {
+        deque_destroy(&workers[i].deque);
+        free(workers[i].out.data);
+        free(workers[i].stats);
+    }
+    free(workers);
+    workers = NULL;
+    num_workers = 0;
+}
 
-        int ctx_id = atoi(command[1]);
-        if (ctx_id < 0 || ctx_id >= NUM_CONTEXTS) {
-            free(op.instruction);
-            continue;
+static void run_ops(Task *task);
+
+/* Look up a context by id, creating it on first use */
+static Context *get_context(int id) {
+    if (num_contexts * 2 >= context_table_cap) {
+        size_t new_cap = context_table_cap ? context_table_cap * 2 : 64;
+        Context **table = calloc(new_cap, sizeof(Context *));
+        if (!table) { perror("calloc"); exit(1); }
+        for (size_t i = 0; i < num_contexts; i++) {
+            Context *c = context_list[i];
+            size_t h = ((uint32_t)c->id * 2654435761u) & (new_cap - 1);
+            while (table[h]) h = (h + 1) & (new_cap - 1);
+            table[h] = c;
         }
+        free(context_table);
+        context_table = table;
+        context_table_cap = new_cap;
+    }
 
-        add_operation(&contexts[ctx_id], op);
+    size_t h = ((uint32_t)id * 2654435761u) & (context_table_cap - 1);
+    while (context_table[h]) {
+        if (context_table[h]->id == id) return context_table[h];
+        h = (h + 1) & (context_table_cap - 1);
     }
 
-    fclose(input_file);
+    Context *ctx = calloc(1, sizeof(Context));
+    if (!ctx) { perror("calloc"); exit(1); }
+    ctx->task.run = run_ops;
+    ctx->id = id;
+    op_queue_init(&ctx->queue, &op_arena, streaming);
+    atomic_flag_clear(&ctx->retiring);
+    atomic_init(&ctx->refs, 1);
+    atomic_fetch_add(&contexts_remaining, 1);
+    context_table[h] = ctx;
 
-    /* Create threads */
-    for (int i = 0; i < NUM_CONTEXTS; i++) {
-        if (contexts[i].op_size > 0) {
-            if (pthread_create(&contexts[i].thread, NULL, run_ops, &contexts[i]) != 0) {
-                perror("pthread_create");
-                return 1;
-            }
+    if (num_contexts == context_list_cap) {
+        context_list_cap = context_list_cap ? context_list_cap * 2 : 64;
+        Context **list = realloc(context_list, context_list_cap * sizeof(Context *));
+        if (!list) { perror("realloc"); exit(1); }
+        context_list = list;
+    }
+    context_list[num_contexts++] = ctx;
+    return ctx;
+}
+
+static void context_finished(void) {
+    if (atomic_fetch_sub(&contexts_remaining, 1) == 1) {
+        pthread_mutex_lock(&done_mutex);
+        pthread_cond_signal(&done_cond);
+        pthread_mutex_unlock(&done_mutex);
+    }
+}
+
+static const char digit_pairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/* Write v in decimal at dst (no terminator); returns the end */
+static char *put_uint(char *dst, uint32_t v) {
+    char tmp[10];
+    char *p = tmp + sizeof(tmp);
+    while (v >= 100) {
+        uint32_t r = v % 100;
+        v /= 100;
+        p -= 2;
+        memcpy(p, &digit_pairs[2 * r], 2);
+    }
+    if (v >= 10) {
+        p -= 2;
+        memcpy(p, &digit_pairs[2 * v], 2);
+    } else {
+        *--p = (char)('0' + v);
+    }
+    size_t n = (size_t)(tmp + sizeof(tmp) - p);
+    memcpy(dst, p, n);
+    return dst + n;
+}
+
+static char *put_int(char *dst, int v) {
+    if (v < 0) {
+        *dst++ = '-';
+        return put_uint(dst, 0u - (uint32_t)v);
+    }
+    return put_uint(dst, (uint32_t)v);
+}
+
+/* "ctx %02d: " */
+static char *put_ctx(char *dst, int id) {
+    memcpy(dst, "ctx ", 4);
+    dst += 4;
+    if (id < 10) *dst++ = '0';
+    dst = put_uint(dst, (uint32_t)id);
+    *dst++ = ':';
+    *dst++ = ' ';
+    return dst;
+}
+
+/* Number of the first k primes below bound */
+static long count_below(const uint32_t *primes, long k, uint32_t bound) {
+    long lo = 0, hi = k;
+    while (lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+        if (primes[mid] < bound) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
     }
+    return lo;
+}
+
+/* Length of ", p" for the first k primes: two separator bytes plus digits */
+static size_t prime_text_offset(const uint32_t *primes, long k) {
+    size_t len = 3 * (size_t)k;
+    uint32_t bound = 10;
+    for (int d = 1; d < 10; d++, bound *= 10) {
+        len += (size_t)(k - count_below(primes, k, bound));
+    }
+    return len;
+}
 
-    /* Join threads */
-    for (int i = 0; i < NUM_CONTEXTS; i++) {
-        if (contexts[i].op_size > 0) {
-            pthread_join(contexts[i].thread, NULL);
+/* ", 2, 3, 5, ..." for the first k primes, formatted once and shared. The
+ * text grows to cover the largest pri served so far. */
+static const char *prime_text_upto(const uint32_t *primes, long k, size_t *len_out) {
+    *len_out = prime_text_offset(primes, k);
+    if (k > atomic_load_explicit(&prime_text_count, memory_order_acquire)) {
+        pthread_mutex_lock(&prime_text_mutex);
+        long done = atomic_load_explicit(&prime_text_count, memory_order_relaxed);
+        size_t used = prime_text_offset(primes, done);
+        char *p = shared_reserve(&prime_text, used, *len_out) + used;
+        for (long i = done; i < k; i++) {
+            *p++ = ',';
+            *p++ = ' ';
+            p = put_uint(p, primes[i]);
         }
+        if (k > done) {
+            atomic_store_explicit(&prime_text_count, k, memory_order_release);
+        }
+        pthread_mutex_unlock(&prime_text_mutex);
     }
+    /* the count was loaded first, so this block covers k */
+    return atomic_load_explicit(&prime_text, memory_order_acquire)->data;
+}
 
-    /* Cleanup */
-    for (int i = 0; i < NUM_CONTEXTS; i++) {
-        free(contexts[i].operations);
+static void slot_finish(RobSlot *slot, char *end) {
+    slot->line = slot->text;
+    slot->len = (size_t)(end - slot->text);
+}
+
+/* "ctx NN: set to value V\n" */
+static void format_set(RobSlot *slot, int id, int value) {
+    char *p = put_ctx(slot->text, id);
+    memcpy(p, "set to value ", 13);
+    p = put_int(p + 13, value);
+    *p++ = '\n';
+    slot_finish(slot, p);
+}
+
+/* "ctx NN: <op> X (result: Y)\n" for add/sub/mul/div */
+static void format_arith(RobSlot *slot, int id, const char *name, int val, int result) {
+    char *p = put_ctx(slot->text, id);
+    memcpy(p, name, 3);
+    p[3] = ' ';
+    p = put_int(p + 4, val);
+    memcpy(p, " (result: ", 10);
+    p = put_int(p + 10, result);
+    *p++ = ')';
+    *p++ = '\n';
+    slot_finish(slot, p);
+}
+
+static void format_fib(RobSlot *slot, int id, int n) {
+    char *p = put_ctx(slot->text, id);
+    memcpy(p, "fib (result: ", 13);
+    p = put_int(p + 13, fib_fast(n));
+    *p++ = ')';
+    *p++ = '\n';
+    slot_finish(slot, p);
+}
+
+typedef double v2df __attribute__((vector_size(16)));
+
+/* Leibniz series, two terms per vector division and no branch. Each term is
+ * computed exactly as the scalar formula would and added in index order, so
+ * the sum matches the scalar loop bit for bit. */
+static double pia_sum(long iterations) {
+    const v2df signs = { 1.0, -1.0 };
+    double sum = 0.0;
+    long k = 0;
+    for (; k + 1 < iterations; k += 2) {
+        v2df den = { 2.0 * (double)k + 1.0, 2.0 * (double)k + 3.0 };
+        v2df t = signs / den;
+        sum += t[0];
+        sum += t[1];
     }
+    if (k < iterations) {
+        sum += 1.0 / (2.0 * (double)k + 1.0);
+    }
+    return sum;
+}
 
-    fclose(output_file);
-    pthread_mutex_destroy(&log_mutex);
+static void format_pia(RobSlot *slot, int id, double pi_approx) {
+    /* 15 digits after decimal point */
+    int n = snprintf(slot->text, ROB_LINE_BYTES, "ctx %02d: pia (result %.15f)\n", id, pi_approx);
+    slot->line = slot->text;
+    slot->len = (size_t)n < ROB_LINE_BYTES ? (size_t)n : ROB_LINE_BYTES - 1;
+}
+
+static void format_pri(RobSlot *slot, int id, int limit) {
+    static const char header[] = "primes (result:";
+    long count;
+    const uint32_t *primes = primes_upto(limit, &count);
+    size_t text_len = 0;
+    const char *text = count > 0 ? prime_text_upto(primes, count, &text_len) : NULL;
+
+    /* "ctx NN: " + header + " p0, p1, ..." + ")\n" */
+    size_t cap = 16 + sizeof(header) + text_len + 2;
+    char *log_line = slot->text;
+    if (cap > ROB_LINE_BYTES) {
+        log_line = malloc(cap);
+        if (!log_line) { perror("malloc"); exit(1); }
+    }
+    char *p = put_ctx(log_line, id);
+    memcpy(p, header, sizeof(header) - 1);
+    p += sizeof(header) - 1;
+    if (count > 0) {
+        /* the list starts with ' ' rather than ", " */
+        *p++ = ' ';
+        memcpy(p, text + 2, text_len - 2);
+        p += text_len - 2;
+    }
+    *p++ = ')';
+    *p++ = '\n';
+    slot->line = log_line;
+    slot->len = (size_t)(p - log_line);
+}
+
+static void context_release(Context *ctx, long n) {
+    if (atomic_fetch_sub(&ctx->refs, n) == n) {
+        context_finished();
+    }
+}
+
+static RobSlot *rob_slot(Context *ctx, unsigned i) {
+    return &ctx->rob[i % ROB_SIZE / ROB_BLOCK_SLOTS][i % ROB_BLOCK_SLOTS];
+}
+
+static int rob_full(Context *ctx) {
+    return atomic_load(&ctx->rob_tail) - atomic_load(&ctx->rob_head) == ROB_SIZE;
+}
+
+static int rob_head_ready(Context *ctx) {
+    unsigned head = atomic_load(&ctx->rob_head);
+    return head != atomic_load(&ctx->rob_tail) && atomic_load(&rob_slot(ctx, head)->ready);
+}
+
+/* Append the lines of slots [start, end), all for one connection, to its
+ * response buffer and hand it to the event loop if it is not queued yet */
+static void conn_deliver(Context *ctx, unsigned start, unsigned end) {
+    Connection *c = conn_table[rob_slot(ctx, start)->conn];
+    int wake = 0;
+
+    pthread_mutex_lock(&c->lock);
+    if (!c->failed) {
+        for (unsigned i = start; i != end; i++) {
+            RobSlot *slot = rob_slot(ctx, i);
+            if (c->out_len + slot->len > c->out_cap) {
+                size_t cap = c->out_cap ? c->out_cap : 4096;
+                while (cap < c->out_len + slot->len) cap *= 2;
+                char *out = realloc(c->out, cap);
+                if (!out) { perror("realloc"); exit(1); }
+                c->out = out;
+                c->out_cap = cap;
+            }
+            memcpy(c->out + c->out_len, slot->line, slot->len);
+            c->out_len += slot->len;
+        }
+    }
+    c->pending -= (long)(end - start);
+    if (!c->queued) {
+        c->queued = 1;
+        pthread_mutex_lock(&ready_mutex);
+        wake = ready_head == NULL;
+        c->next_ready = ready_head;
+        ready_head = c;
+        pthread_mutex_unlock(&ready_mutex);
+    }
+    /* the event loop may free c once this unlock completes */
+    pthread_mutex_unlock(&c->lock);
+
+    if (wake) {
+        uint64_t one = 1;
+        if (write(server_event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            perror("write eventfd");
+        }
+    }
+}
+
+/* Write out retired slots [start, end). The file range is reserved here,
+ * under the retiring flag, so a context's lines land in order no matter
+ * which worker buffers them or when that buffer is flushed. In server mode
+ * each run of slots from one connection goes to that connection instead. */
+static void emit_lines(Context *ctx, unsigned start, unsigned end, size_t bytes) {
+    if (serving) {
+        /* a connection's requests to one context usually retire together */
+        unsigned i = start;
+        while (i != end) {
+            unsigned j = i + 1;
+            while (j != end && rob_slot(ctx, j)->conn == rob_slot(ctx, i)->conn) j++;
+            conn_deliver(ctx, i, j);
+            i = j;
+        }
+    } else if (deterministic) {
+        if (ctx->det_len + bytes > ctx->det_cap) {
+            /* sized to the first retire, then doubled: most contexts are short */
+            size_t cap = ctx->det_cap * 2;
+            if (cap < ctx->det_len + bytes) cap = ctx->det_len + bytes;
+            char *out = realloc(ctx->det_out, cap);
+            if (!out) { perror("realloc"); exit(1); }
+            ctx->det_out = out;
+            ctx->det_cap = cap;
+        }
+    } else if (!output_seekable) {
+        /* nothing to reserve: a stream's order is the order of this lock */
+        pthread_mutex_lock(&stream_mutex);
+    }
+    off_t offset = deterministic || serving || !output_seekable ? 0 :
+        (off_t)atomic_fetch_add(&output_offset, (long long)bytes);
+
+    for (unsigned i = start; i != end; i++) {
+        RobSlot *slot = rob_slot(ctx, i);
+        if (serving) {
+            /* already delivered */
+        } else if (deterministic) {
+            memcpy(ctx->det_out + ctx->det_len, slot->line, slot->len);
+            ctx->det_len += slot->len;
+        } else if (!output_seekable) {
+            stream_write(slot->line, slot->len);
+        } else {
+            out_write(&self_worker->out, offset, slot->line, slot->len);
+            offset += (off_t)slot->len;
+        }
+        if (slot->line != slot->text) {
+            free(slot->line);
+        }
+    }
+    if (!serving && !deterministic && !output_seekable) {
+        pthread_mutex_unlock(&stream_mutex);
+    }
+}
+
+/* Emit completed log lines in program order. Whoever holds the retiring flag
+ * writes; anyone else that finishes a slot meanwhile leaves it to them. */
+static void rob_retire(Context *ctx) {
+    while (1) {
+        if (atomic_flag_test_and_set(&ctx->retiring)) {
+            return;
+        }
+
+        unsigned head = atomic_load_explicit(&ctx->rob_head, memory_order_relaxed);
+        unsigned tail = atomic_load(&ctx->rob_tail);
+        unsigned start = head;
+        size_t bytes = 0;
+        while (head != tail && atomic_load(&rob_slot(ctx, head)->ready)) {
+            bytes += rob_slot(ctx, head)->len;
+            head++;
+        }
+        if (head != start) {
+            emit_lines(ctx, start, head, bytes);
+        }
+        atomic_store(&ctx->rob_head, head);
+        atomic_flag_clear(&ctx->retiring);
+
+        if (head != start) {
+            /* The segment stopped on a full ROB; it can make progress again */
+            if (atomic_exchange(&ctx->parked, 0)) {
+                pool_submit(&ctx->task);
+            }
+            context_release(ctx, (long)(head - start));
+        }
+
+        /* A slot may have completed after we looked but before we let go */
+        if (!rob_head_ready(ctx)) {
+            return;
+        }
+    }
+}
+
+static void heavy_op_complete(HeavyOp *h) {
+    Context *ctx = h->ctx;
+    if (stats_enabled) {
+        int opcode = h->kind == HEAVY_PIA ? OP_PIA : OP_PRI;
+        stat_add(&self_worker->stats->count[opcode], 1);
+        stats_record(opcode, now_ns() - h->start_ns);
+    }
+    atomic_store(&h->slot->ready, 1);
+    free(h);
+    rob_retire(ctx);
+}
+
+/* pia/pri only read the context value, so they run from a snapshot on
+ * any worker while the context carries on with its arithmetic */
+static void run_heavy_op(Task *task) {
+    HeavyOp *h = (HeavyOp *)task;
+    int value = h->value < 0 ? 0 : h->value;
+
+    switch (h->kind) {
+    case HEAVY_PIA:
+        format_pia(h->slot, h->ctx->id, 4.0 * pia_sum(value));
+        heavy_op_complete(h);
+        break;
+    case HEAVY_PRI:
+        format_pri(h->slot, h->ctx->id, h->value);
+        heavy_op_complete(h);
+        break;
+    }
+}
+
+/* Run one segment of a context's ops. The context is never queued more than
+ * once, so its ops execute in order even when segments land on different
+ * workers; heavy ops complete out of order and are put back in order by the
+ * reorder buffer. */
+static void run_ops(Task *task) {
+    Context *ctx = (Context *)task;
+    OpQueue *q = &ctx->queue;
+
+    for (int n = 0; n < SEGMENT_OPS; n++) {
+        int heavy = -1;
+
+        while (rob_full(ctx)) {
+            rob_retire(ctx);
+            if (!rob_full(ctx)) break;
+            /* Still waiting on the oldest heavy op: hand the worker back and
+             * let its completion reschedule us */
+            atomic_store(&ctx->parked, 1);
+            if (rob_full(ctx) || !atomic_exchange(&ctx->parked, 0)) {
+                return;
+            }
+        }
+
+        Operation op;
+        if (!op_queue_pop(q, &op)) {
+            if (atomic_load(&ctx->closed) && op_queue_empty(q)) {
+                rob_retire(ctx);
+                if (!ctx->drained) {
+                    /* drop the runner's reference; unretired slots hold the rest */
+                    ctx->drained = 1;
+                    context_release(ctx, 1);
+                }
+                return;
+            }
+            /* Caught up with the parser: go idle unless an op or the close
+             * raced with us, in which case we stay scheduled */
+            atomic_store(&ctx->scheduled, 0);
+            if ((!op_queue_empty(q) || atomic_load(&ctx->closed)) &&
+                !atomic_exchange(&ctx->scheduled, 1)) {
+                n--;
+                continue;
+            }
+            rob_retire(ctx);
+            return;
+        }
+
+        unsigned tail = atomic_load_explicit(&ctx->rob_tail, memory_order_relaxed);
+        RobSlot **block = &ctx->rob[tail % ROB_SIZE / ROB_BLOCK_SLOTS];
+        if (!*block) {
+            *block = calloc(ROB_BLOCK_SLOTS, sizeof(RobSlot));
+            if (!*block) { perror("calloc"); exit(1); }
+        }
+        RobSlot *slot = rob_slot(ctx, tail);
+        slot->conn = op.conn;
+        /* cheap ops are timed on a sample; heavy ops always */
+        int timed = stats_enabled && (op.opcode >= OP_PIA || (n & (STATS_SAMPLE - 1)) == 0);
+        uint64_t start = timed ? now_ns() : 0;
+
+        switch (op.opcode) {
+        case OP_SET:
+            ctx->value = op.val;
+            format_set(slot, ctx->id, ctx->value);
+            break;
+        case OP_ADD:
+            ctx->value += op.val;
+            format_arith(slot, ctx->id, "add", op.val, ctx->value);
+            break;
+        case OP_SUB:
+            ctx->value -= op.val;
+            format_arith(slot, ctx->id, "sub", op.val, ctx->value);
+            break;
+        case OP_MUL:
+            ctx->value *= op.val;
+            format_arith(slot, ctx->id, "mul", op.val, ctx->value);
+            break;
+        case OP_DIV:
+            /* assume well-formed input; no division by zero */
+            ctx->value /= op.val;
+            format_arith(slot, ctx->id, "div", op.val, ctx->value);
+            break;
+        case OP_FIB:
+            /* cheap enough now to stay inline rather than go through the pool */
+            format_fib(slot, ctx->id, ctx->value);
+            break;
+        case OP_PIA:
+            heavy = HEAVY_PIA;
+            break;
+        case OP_PRI:
+            heavy = HEAVY_PRI;
+            break;
+        }
+
+        atomic_store_explicit(&slot->ready, heavy < 0, memory_order_relaxed);
+        atomic_fetch_add(&ctx->refs, 1);
+        atomic_store(&ctx->rob_tail, tail + 1);
+
+        if (stats_enabled) {
+            WorkerStats *st = self_worker->stats;
+            stat_add(&st->ops, 1);
+            /* heavy ops are counted and timed when they complete */
+            if (heavy < 0) {
+                stat_add(&st->count[op.opcode], 1);
+                if (timed) stats_record(op.opcode, now_ns() - start);
+            }
+        }
+
+        if (heavy >= 0) {
+            HeavyOp *h = malloc(sizeof(HeavyOp));
+            if (!h) { perror("malloc"); exit(1); }
+            h->task.run = run_heavy_op;
+            h->ctx = ctx;
+            h->slot = slot;
+            h->kind = heavy;
+            h->value = ctx->value;
+            h->start_ns = start;
+            pool_submit(&h->task);
+        }
+    }
+
+    /* Push out what is already in order before giving up the worker */
+    rob_retire(ctx);
+    pool_submit(&ctx->task);
+}
+
+/* Queue an op for its context and wake the context if it went idle */
+/* Streaming contexts the parser has queued ops for but not scheduled */
+static Context **deferred_contexts = NULL;
+static size_t num_deferred = 0;
+static size_t deferred_cap = 0;
+
+static void submit_operation(Context *ctx, Operation op) {
+    op_queue_push(&ctx->queue, op);
+    if (stats_enabled) stat_add(&stats_submitted, 1);
+    if (!(streaming || serving) || atomic_load(&ctx->scheduled)) {
+        return;
+    }
+    /* Streaming: waking a worker for every op of a context that keeps
+     * catching up costs more than the op. Hold the context back until it
+     * has a batch, or until the parser next reads. */
+    if (!serving && atomic_load_explicit(&ctx->queue.pushed, memory_order_relaxed) -
+                    atomic_load(&ctx->queue.popped) < STREAM_SUBMIT_OPS) {
+        if (!ctx->deferred) {
+            if (num_deferred == deferred_cap) {
+                deferred_cap = deferred_cap ? deferred_cap * 2 : 64;
+                Context **list = realloc(deferred_contexts, deferred_cap * sizeof(Context *));
+                if (!list) { perror("realloc"); exit(1); }
+                deferred_contexts = list;
+            }
+            ctx->deferred = 1;
+            deferred_contexts[num_deferred++] = ctx;
+        }
+        return;
+    }
+    if (!atomic_exchange(&ctx->scheduled, 1)) {
+        pool_submit(&ctx->task);
+    }
+}
+
+/* Schedule every context held back by submit_operation */
+static void submit_deferred(void) {
+    for (size_t i = 0; i < num_deferred; i++) {
+        Context *ctx = deferred_contexts[i];
+        ctx->deferred = 0;
+        if (!atomic_load(&ctx->scheduled) && !op_queue_empty(&ctx->queue) &&
+            !atomic_exchange(&ctx->scheduled, 1)) {
+            pool_submit(&ctx->task);
+        }
+    }
+    num_deferred = 0;
+}
+
+/* No more input: let every context drain and finish */
+static void close_contexts(void) {
+    for (size_t i = 0; i < num_contexts; i++) {
+        Context *ctx = context_list[i];
+        atomic_store(&ctx->closed, 1);
+        if (!atomic_load(&ctx->scheduled) && !atomic_exchange(&ctx->scheduled, 1)) {
+            pool_submit(&ctx->task);
+        }
+    }
+}
+
+static int compare_context_ids(const void *a, const void *b) {
+    int x = (*(Context *const *)a)->id;
+    int y = (*(Context *const *)b)->id;
+    return (x > y) - (x < y);
+}
+
+/* This job's segment for a context id, created on first use */
+static ParseSegment *parse_segment(ParseJob *job, int id) {
+    if (job->num_segments * 2 >= job->index_cap) {
+        size_t new_cap = job->index_cap ? job->index_cap * 2 : 64;
+        size_t *index = calloc(new_cap, sizeof(size_t));
+        if (!index) { perror("calloc"); exit(1); }
+        for (size_t i = 0; i < job->num_segments; i++) {
+            size_t h = ((uint32_t)job->segments[i].id * 2654435761u) & (new_cap - 1);
+            while (index[h]) h = (h + 1) & (new_cap - 1);
+            index[h] = i + 1;
+        }
+        free(job->index);
+        job->index = index;
+        job->index_cap = new_cap;
+    }
+
+    size_t h = ((uint32_t)id * 2654435761u) & (job->index_cap - 1);
+    while (job->index[h]) {
+        ParseSegment *seg = &job->segments[job->index[h] - 1];
+        if (seg->id == id) return seg;
+        h = (h + 1) & (job->index_cap - 1);
+    }
+
+    if (job->num_segments == job->segments_cap) {
+        job->segments_cap = job->segments_cap ? job->segments_cap * 2 : 64;
+        ParseSegment *segments = realloc(job->segments, job->segments_cap * sizeof(ParseSegment));
+        if (!segments) { perror("realloc"); exit(1); }
+        job->segments = segments;
+    }
+    ParseSegment *seg = &job->segments[job->num_segments++];
+    seg->id = id;
+    seg->first = seg->last = arena_alloc_chunk(&job->arena, OP_CHUNK_SMALL_OPS);
+    seg->last_pos = 0;
+    seg->count = 0;
+    job->index[h] = job->num_segments;
+    return seg;
+}
+
+static void run_parse_job(Task *task) {
+    ParseJob *job = (ParseJob *)task;
+    const char *p = job->begin;
+    ParseSegment *seg = NULL;
+
+    while (p < job->end) {
+        const char *nl = memchr(p, '\n', (size_t)(job->end - p));
+        const char *line_end = nl ? nl : job->end;
+        int ctx_id;
+        Operation op;
+        if (parse_line(p, line_end, &ctx_id, &op)) {
+            /* runs of one context are common; skip the lookup for them */
+            if (!seg || seg->id != ctx_id) {
+                seg = parse_segment(job, ctx_id);
+            }
+            if (seg->last_pos == seg->last->cap) {
+                OpChunk *c = arena_alloc_chunk(&job->arena, OP_CHUNK_OPS);
+                seg->last->next = c;
+                seg->last = c;
+                seg->last_pos = 0;
+            }
+            seg->last->ops[seg->last_pos++] = op;
+            seg->count++;
+        }
+        p = line_end + 1;
+    }
+
+    if (atomic_fetch_sub(&parse_jobs_remaining, 1) == 1) {
+        pthread_mutex_lock(&done_mutex);
+        pthread_cond_signal(&done_cond);
+        pthread_mutex_unlock(&done_mutex);
+    }
+}
+
+/* Batch parse of a regular file: map it, split it at newlines into slices
+ * parsed in parallel on the pool, then stitch every slice's segments onto
+ * the context queues in file order. Returns the jobs, whose arenas still
+ * own the queued chunks. */
+static ParseJob *parse_mapped(int fd, size_t size, int *num_jobs_out) {
+    char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        perror("mmap input");
+        exit(1);
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    long num_jobs = (long)num_workers * PARSE_JOBS_PER_WORKER;
+    if ((long)(size / PARSE_SLICE_MIN_BYTES) < num_jobs) {
+        num_jobs = (long)(size / PARSE_SLICE_MIN_BYTES);
+    }
+    if (num_jobs < 1) {
+        num_jobs = 1;
+    }
+
+    ParseJob *jobs = calloc((size_t)num_jobs, sizeof(ParseJob));
+    if (!jobs) { perror("calloc"); exit(1); }
+    atomic_store(&parse_jobs_remaining, num_jobs);
+
+    const char *end = data + size;
+    const char *begin = data;
+    for (long i = 0; i < num_jobs; i++) {
+        /* each slice ends just past the first newline at or after its share */
+        const char *slice_end = end;
+        if (i + 1 < num_jobs) {
+            slice_end = data + (size_t)((double)size * (double)(i + 1) / (double)num_jobs);
+            if (slice_end < begin) slice_end = begin;
+            const char *nl = memchr(slice_end, '\n', (size_t)(end - slice_end));
+            slice_end = nl ? nl + 1 : end;
+        }
+        ParseJob *job = &jobs[i];
+        job->task.run = run_parse_job;
+        job->begin = begin;
+        job->end = slice_end;
+        pthread_mutex_init(&job->arena.lock, NULL);
+        begin = slice_end;
+    }
+    for (long i = 0; i < num_jobs; i++) {
+        pool_submit(&jobs[i].task);
+    }
+
+    pthread_mutex_lock(&done_mutex);
+    while (atomic_load(&parse_jobs_remaining) > 0) {
+        pthread_cond_wait(&done_cond, &done_mutex);
+    }
+    pthread_mutex_unlock(&done_mutex);
+    munmap(data, size);
+
+    for (long i = 0; i < num_jobs; i++) {
+        ParseJob *job = &jobs[i];
+        for (size_t s = 0; s < job->num_segments; s++) {
+            ParseSegment *seg = &job->segments[s];
+            op_queue_append(&get_context(seg->id)->queue, seg->first, seg->last,
+                            seg->last_pos, seg->count);
+            if (stats_enabled) stat_add(&stats_submitted, seg->count);
+        }
+        free(job->segments);
+        free(job->index);
+        job->segments = NULL;
+        job->index = NULL;
+    }
+
+    *num_jobs_out = (int)num_jobs;
+    return jobs;
+}
+
+/* Parse a line and queue its op */
+static void parse_and_submit(const char *p, const char *end) {
+    int ctx_id;
+    Operation op;
+    if (parse_line(p, end, &ctx_id, &op)) {
+        submit_operation(get_context(ctx_id), op);
+    }
+}
+
+/* Sequential parse with read(): streaming mode and inputs that cannot be mapped */
+static void parse_stream(int fd) {
+    size_t cap = READ_BUFFER_BYTES;
+    size_t len = 0;
+    char *buf = malloc(cap);
+    if (!buf) { perror("malloc"); exit(1); }
+
+    while (1) {
+        if (len == cap) {
+            /* one line longer than the buffer */
+            cap *= 2;
+            char *grown = realloc(buf, cap);
+            if (!grown) { perror("realloc"); exit(1); }
+            buf = grown;
+        }
+        /* the read may block; let the pool have what is queued */
+        submit_deferred();
+        ssize_t n = read(fd, buf + len, cap - len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("read input");
+            exit(1);
+        }
+        if (n == 0) break;
+
+        const char *p = buf;
+        const char *end = buf + len + (size_t)n;
+        const char *nl;
+        while ((nl = memchr(p, '\n', (size_t)(end - p))) != NULL) {
+            parse_and_submit(p, nl);
+            p = nl + 1;
+        }
+        len = (size_t)(end - p);
+        memmove(buf, p, len);
+    }
+    if (len > 0) {
+        parse_and_submit(buf, buf + len);
+    }
+    submit_deferred();
+    free(deferred_contexts);
+    deferred_contexts = NULL;
+    deferred_cap = 0;
+    free(buf);
+}
+
+static void on_server_signal(int sig) {
+    (void)sig;
+    server_stop = 1;
+}
+
+/* Listening socket for "[host:]port", or a Unix socket for anything with a '/' */
+static int server_listen(const char *addr) {
+    int fd;
+    if (strchr(addr, '/')) {
+        struct sockaddr_un sun;
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        if (strlen(addr) >= sizeof(sun.sun_path)) {
+            fprintf(stderr, "Socket path too long: %s\n", addr);
+            exit(1);
+        }
+        strcpy(sun.sun_path, addr);
+        /* replace a socket left behind by an earlier run */
+        struct stat st;
+        if (stat(addr, &st) == 0 && S_ISSOCK(st.st_mode)) {
+            unlink(addr);
+        }
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+            perror(addr);
+            exit(1);
+        }
+    } else {
+        char host[256];
+        const char *port = strrchr(addr, ':');
+        const char *node = NULL;
+        if (port) {
+            size_t len = (size_t)(port - addr);
+            if (len >= sizeof(host)) len = sizeof(host) - 1;
+            memcpy(host, addr, len);
+            host[len] = '\0';
+            node = host[0] ? host : NULL;
+            port++;
+        } else {
+            port = addr;
+        }
+
+        struct addrinfo hints, *res;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        int rc = getaddrinfo(node, port, &hints, &res);
+        if (rc != 0) {
+            fprintf(stderr, "%s: %s\n", addr, gai_strerror(rc));
+            exit(1);
+        }
+        fd = -1;
+        for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+            if (fd < 0) continue;
+            int one = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(res);
+        if (fd < 0) {
+            perror(addr);
+            exit(1);
+        }
+    }
+    if (listen(fd, SOMAXCONN) < 0) {
+        perror("listen");
+        exit(1);
+    }
+    return fd;
+}
+
+static void conn_open(int epoll_fd, int fd) {
+    if (conn_num_free == 0 && conn_next_index == SERVER_MAX_CONNECTIONS) {
+        close(fd);
+        return;
+    }
+    Connection *c = calloc(1, sizeof(Connection));
+    if (!c) { perror("calloc"); exit(1); }
+    c->fd = fd;
+    c->index = conn_num_free ? conn_free_indices[--conn_num_free] : conn_next_index++;
+    c->events = EPOLLIN;
+    pthread_mutex_init(&c->lock, NULL);
+
+    /* responses are small and pipelined; do not hold them back (fails harmlessly off TCP) */
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    struct epoll_event ev = { .events = c->events, .data.u64 = (uint64_t)c->index + 2 };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+    conn_table[c->index] = c;
+}
+
+/* The index goes back on the free list at the next event-loop round, so a
+ * stale event from this round cannot reach a new connection */
+static void conn_free(Connection *c) {
+    if (c->fd >= 0) {
+        close(c->fd);
+    }
+    conn_table[c->index] = NULL;
+    conn_retired_indices[conn_num_retired++] = c->index;
+    pthread_mutex_destroy(&c->lock);
+    free(c->in);
+    free(c->send);
+    free(c->out);
+    free(c);
+}
+
+/* Drop the socket; responses still owed are discarded as they retire */
+static void conn_fail(Connection *c) {
+    close(c->fd);
+    c->fd = -1;
+    c->read_closed = 1;
+    c->send_len = c->send_pos = 0;
+    pthread_mutex_lock(&c->lock);
+    c->failed = 1;
+    c->out_len = 0;
+    pthread_mutex_unlock(&c->lock);
+}
+
+/* Send what the socket will take, swapping in newly retired responses */
+static void conn_flush(Connection *c) {
+    while (1) {
+        if (c->send_pos == c->send_len) {
+            pthread_mutex_lock(&c->lock);
+            char *buf = c->send;
+            size_t cap = c->send_cap;
+            c->send = c->out;
+            c->send_cap = c->out_cap;
+            c->send_len = c->out_len;
+            c->out = buf;
+            c->out_cap = cap;
+            c->out_len = 0;
+            pthread_mutex_unlock(&c->lock);
+            c->send_pos = 0;
+            if (c->send_len == 0) return;
+        }
+        ssize_t n = send(c->fd, c->send + c->send_pos, c->send_len - c->send_pos, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) conn_fail(c);
+            return;
+        }
+        c->send_pos += (size_t)n;
+    }
+}
+
+static long conn_submit(Connection *c, const char *p, const char *end) {
+    int ctx_id;
+    Operation op;
+    if (!parse_line(p, end, &ctx_id, &op)) {
+        return 0;
+    }
+    op.conn = c->index;
+    submit_operation(get_context(ctx_id), op);
+    return 1;
+}
+
+/* Read and queue every complete request line */
+static void conn_read(Connection *c) {
+    if (c->in_len == c->in_cap) {
+        c->in_cap = c->in_cap ? c->in_cap * 2 : READ_BUFFER_BYTES;
+        char *in = realloc(c->in, c->in_cap);
+        if (!in) { perror("realloc"); exit(1); }
+        c->in = in;
+    }
+    ssize_t n = read(c->fd, c->in + c->in_len, c->in_cap - c->in_len);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) conn_fail(c);
+        return;
+    }
+
+    long submitted = 0;
+    const char *p = c->in;
+    const char *end = c->in + c->in_len + n;
+    const char *nl;
+    while ((nl = memchr(p, '\n', (size_t)(end - p))) != NULL) {
+        submitted += conn_submit(c, p, nl);
+        p = nl + 1;
+    }
+    if (n == 0) {
+        /* the peer is done sending; a last unterminated line still counts */
+        if (p < end) {
+            submitted += conn_submit(c, p, end);
+        }
+        p = end;
+        c->read_closed = 1;
+    }
+    c->in_len = (size_t)(end - p);
+    memmove(c->in, p, c->in_len);
+
+    /* Workers may already have answered some of these and taken pending
+     * below zero; nothing acts on the count until the event loop has
+     * added them here */
+    if (submitted) {
+        pthread_mutex_lock(&c->lock);
+        c->pending += submitted;
+        pthread_mutex_unlock(&c->lock);
+    }
+}
+
+/* Close a finished connection, or pick the events it should wait for. A
+ * client is not read while its responses are backed up or too many of its
+ * requests are in flight. */
+static void conn_update(int epoll_fd, Connection *c) {
+    pthread_mutex_lock(&c->lock);
+    long pending = c->pending;
+    int out_waiting = c->out_len > 0;
+    int queued = c->queued;
+    pthread_mutex_unlock(&c->lock);
+    int sending = c->send_pos < c->send_len || out_waiting;
+
+    if (pending == 0 && (c->fd < 0 || (c->read_closed && !sending))) {
+        /* a queued connection is freed when the ready list reaches it */
+        if (!queued) {
+            conn_free(c);
+        }
+        return;
+    }
+    if (c->fd < 0) {
+        return;
+    }
+
+    uint32_t events = 0;
+    if (!c->read_closed && !sending && pending < CONN_MAX_PENDING) events |= EPOLLIN;
+    if (sending) events |= EPOLLOUT;
+    if (events != c->events) {
+        struct epoll_event ev = { .events = events, .data.u64 = (uint64_t)c->index + 2 };
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev) < 0) {
+            perror("epoll_ctl");
+            exit(1);
+        }
+        c->events = events;
+    }
+}
+
+/* Server mode: accept clients on addr and run their pipelined requests until
+ * SIGINT or SIGTERM. Contexts are shared by all clients; each response goes
+ * back to the connection that sent the request, in request order per context. */
+static void serve(const char *addr, int threads) {
+    conn_table = calloc(SERVER_MAX_CONNECTIONS, sizeof(Connection *));
+    conn_free_indices = malloc(SERVER_MAX_CONNECTIONS * sizeof(uint32_t));
+    conn_retired_indices = malloc(SERVER_MAX_CONNECTIONS * sizeof(uint32_t));
+    if (!conn_table || !conn_free_indices || !conn_retired_indices) {
+        perror("malloc");
+        exit(1);
+    }
+
+    /* Workers inherit the blocked mask; the loop takes the signals only
+     * inside epoll_pwait, so a stop request is never missed */
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_server_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigset_t block, wait_mask;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &wait_mask);
+
+    int listen_fd = server_listen(addr);
+    server_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (server_event_fd < 0 || epoll_fd < 0) {
+        perror("epoll");
+        exit(1);
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = 0 };
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+    ev.data.u64 = 1;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_event_fd, &ev);
+
+    pool_start(threads);
+
+    struct epoll_event events[SERVER_EVENTS];
+    while (!server_stop) {
+        while (conn_num_retired > 0) {
+            conn_free_indices[conn_num_free++] = conn_retired_indices[--conn_num_retired];
+        }
+        int n = epoll_pwait(epoll_fd, events, SERVER_EVENTS, -1, &wait_mask);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            exit(1);
+        }
+
+        for (int i = 0; i < n; i++) {
+            uint64_t key = events[i].data.u64;
+            if (key == 0) {
+                int fd;
+                while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                    conn_open(epoll_fd, fd);
+                }
+            } else if (key == 1) {
+                uint64_t count;
+                if (read(server_event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                    perror("read eventfd");
+                }
+                pthread_mutex_lock(&ready_mutex);
+                Connection *c = ready_head;
+                ready_head = NULL;
+                pthread_mutex_unlock(&ready_mutex);
+                while (c) {
+                    Connection *next = c->next_ready;
+                    pthread_mutex_lock(&c->lock);
+                    c->queued = 0;
+                    pthread_mutex_unlock(&c->lock);
+                    if (c->fd >= 0) {
+                        conn_flush(c);
+                    }
+                    conn_update(epoll_fd, c);
+                    c = next;
+                }
+            } else {
+                Connection *c = conn_table[key - 2];
+                if (!c || c->fd < 0) continue;
+                uint32_t what = events[i].events;
+                if (what & EPOLLIN) {
+                    conn_read(c);
+                } else if (what & (EPOLLERR | EPOLLHUP)) {
+                    /* gone in both directions; nobody is left to answer */
+                    conn_fail(c);
+                }
+                if (c->fd >= 0 && (what & EPOLLOUT)) {
+                    conn_flush(c);
+                }
+                conn_update(epoll_fd, c);
+            }
+        }
+    }
+
+    /* Stop taking requests; what is queued still runs but is not sent */
+    close(listen_fd);
+    if (strchr(addr, '/')) {
+        unlink(addr);
+    }
+    for (uint32_t i = 0; i < conn_next_index; i++) {
+        if (conn_table[i] && conn_table[i]->fd >= 0) {
+            conn_fail(conn_table[i]);
+        }
+    }
+    close(epoll_fd);
+
+    /* a second signal ends the process outright */
+    sa.sa_handler = SIG_DFL;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    pthread_sigmask(SIG_SETMASK, &wait_mask, NULL);
+}
+
+/* After the pool has stopped, nothing can reach a connection any more */
+static void server_cleanup(void) {
+    for (uint32_t i = 0; i < conn_next_index; i++) {
+        if (conn_table[i]) {
+            conn_free(conn_table[i]);
+        }
+    }
+    free(conn_table);
+    free(conn_free_indices);
+    free(conn_retired_indices);
+    close(server_event_fd);
+}
+
+int main(int argc, char *argv[]) {
+    const char usage[] =
+        "Usage: mathserver.out [-t threads] [-S] [-i seconds] [-s] [-d] <input trace> <output trace>\n"
+        "       mathserver.out [-t threads] [-S] [-i seconds] -l <[host:]port | unix socket path>\n";
+    char *input_trace;
+    char *output_trace;
+    char *listen_addr = NULL;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    ParseJob *parse_jobs = NULL;
+    int num_parse_jobs = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:sdl:Si:")) != -1) {
+        switch (opt) {
+        case 't':
+            threads = atol(optarg);
+            break;
+        case 's':
+            streaming = 1;
+            break;
+        case 'd':
+            deterministic = 1;
+            break;
+        case 'l':
+            listen_addr = optarg;
+            break;
+        case 'S':
+            stats_enabled = 1;
+            break;
+        case 'i':
+            stats_enabled = 1;
+            stats_interval = atof(optarg);
+            break;
+        default:
+            printf("%s", usage);
+            return 1;
+        }
+    }
+
+    if (stats_enabled) {
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGUSR1);
+        pthread_sigmask(SIG_BLOCK, &set, NULL);
+    }
+
+    if (listen_addr) {
+        if (argc - optind != 0 || threads < 1 || streaming || deterministic) {
+            printf("%s", usage);
+            return 1;
+        }
+        serving = 1;
+        serve(listen_addr, (int)threads);
+    } else {
+        if (argc - optind != 2 || threads < 1) {
+            printf("%s", usage);
+            return 1;
+        }
+
+        input_trace = argv[optind];
+        output_trace = argv[optind + 1];
+
+        int input_fd = open(input_trace, O_RDONLY);
+        if (input_fd < 0) {
+            perror("Error opening input file");
+            return 1;
+        }
+        output_fd = open(output_trace, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (output_fd < 0) {
+            perror("Error opening output file");
+            close(input_fd);
+            return 1;
+        }
+        struct stat out_st;
+        if (fstat(output_fd, &out_st) == 0 && !S_ISREG(out_st.st_mode)) {
+            output_seekable = 0;
+            stream_buf = malloc(OUT_BUFFER_BYTES);
+            if (!stream_buf) { perror("malloc"); exit(1); }
+        }
+
+        /* The pool parses the input too, so it starts first in both modes.
+         * Streaming: workers run ops as the parser queues them. Batch: queue
+         * everything first, then run. */
+        pool_start((int)threads);
+
+        /* Read input and build operation queues */
+        struct stat st;
+        if (!streaming && fstat(input_fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            parse_jobs = parse_mapped(input_fd, (size_t)st.st_size, &num_parse_jobs);
+        } else {
+            parse_stream(input_fd);
+        }
+        close(input_fd);
+    }
+
+    close_contexts();
+
+    pthread_mutex_lock(&done_mutex);
+    while (atomic_load(&contexts_remaining) > 0) {
+        pthread_cond_wait(&done_cond, &done_mutex);
+    }
+    pthread_mutex_unlock(&done_mutex);
+    pool_stop();
+    if (stream_len > 0) {
+        write_fully(output_fd, stream_buf, stream_len, 0);
+    }
+
+    /* Deterministic mode: every context's lines, contexts in id order */
+    if (deterministic) {
+        qsort(context_list, num_contexts, sizeof(Context *), compare_context_ids);
+        off_t offset = 0;
+        for (size_t i = 0; i < num_contexts; i++) {
+            write_fully(output_fd, context_list[i]->det_out, context_list[i]->det_len, offset);
+            offset += (off_t)context_list[i]->det_len;
+        }
+    }
+
+    /* Cleanup */
+    for (size_t i = 0; i < num_contexts; i++) {
+        free(context_list[i]->det_out);
+        for (int b = 0; b < ROB_BLOCKS; b++) {
+            free(context_list[i]->rob[b]);
+        }
+        free(context_list[i]);
+    }
+    free(stream_buf);
+    arena_destroy(&op_arena);
+    for (int i = 0; i < num_parse_jobs; i++) {
+        arena_destroy(&parse_jobs[i].arena);
+    }
+    free(parse_jobs);
+    free(context_list);
+    free(context_table);
+    if (serving) {
+        server_cleanup();
+    } else {
+        close(output_fd);
+    }
 
     return 0;
 }
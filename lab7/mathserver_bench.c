@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <spawn.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "mathutil.h"
+
+/* Thread-scaling benchmark for mathserver.
+ *
+ * Generates one trace with mathgen, then runs mathserver over it at 1, 2,
+ * 4, ... up to -j threads (always including -j itself). Only the
+ * mathserver run is timed, and the best of -x repeats is kept; -e runs it
+ * in streaming mode (-s). Workload options are mathgen's. Reports ops/sec,
+ * wall time, speedup over one thread and output bytes/sec. */
+
+#define GEN_OPTS "nsckfprVDPR"   /* passed through to mathgen */
+#define NUM_GEN_OPTS 11
+
+extern char **environ;
+
+/* Spawn argv and wait; returns the child's exit status or -1 */
+static int run(char *const argv[]) {
+    pid_t pid;
+    int err = posix_spawn(&pid, argv[0], NULL, NULL, argv, environ);
+    if (err != 0) {
+        errno = err;
+        perror(argv[0]);
+        return -1;
+    }
+    int status;
+    if (waitpid(pid, &status, 0) < 0) {
+        perror("waitpid");
+        return -1;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+int main(int argc, char *argv[]) {
+    const char usage[] =
+        "Usage: mathserver_bench.out [-n ops] [-s seed] [-c contexts] [-k context skew]\n"
+        "                            [-f fib per mille] [-p pia per mille] [-r pri per mille]\n"
+        "                            [-V max operand] [-D uniform|log] [-P pia iterations]\n"
+        "                            [-R pri limit] [-j max threads] [-x repeats] [-e]\n"
+        "                            [-g mathgen binary] [-m mathserver binary] [-d trace dir]\n";
+    char *gen_values[NUM_GEN_OPTS] = { NULL };
+    const char *num_ops = "1000000";
+    long max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int repeats = 3;
+    int streaming = 0;
+    const char *mathgen_bin = "./mathgen.out";
+    const char *mathserver_bin = "./mathserver.out";
+    const char *trace_dir = "/tmp";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:c:k:f:p:r:V:D:P:R:j:x:eg:m:d:")) != -1) {
+        const char *gen_opt = strchr(GEN_OPTS, opt);
+        if (gen_opt) {
+            gen_values[gen_opt - GEN_OPTS] = optarg;
+            if (opt == 'n') num_ops = optarg;
+            continue;
+        }
+        switch (opt) {
+        case 'j': max_threads = atol(optarg); break;
+        case 'x': repeats = atoi(optarg); break;
+        case 'e': streaming = 1; break;
+        case 'g': mathgen_bin = optarg; break;
+        case 'm': mathserver_bin = optarg; break;
+        case 'd': trace_dir = optarg; break;
+        default:
+            printf("%s", usage);
+            return 1;
+        }
+    }
+    if (optind != argc || repeats < 1 || max_threads < 1) {
+        printf("%s", usage);
+        return 1;
+    }
+
+    char trace_path[4096], output_path[4096];
+    snprintf(trace_path, sizeof(trace_path), "%s/mathserver_bench_%d.trace", trace_dir, (int)getpid());
+    snprintf(output_path, sizeof(output_path), "%s/mathserver_bench_%d.out", trace_dir, (int)getpid());
+
+    char gen_flags[NUM_GEN_OPTS][3];
+    char *gen_argv[2 * NUM_GEN_OPTS + 4];
+    int g = 0;
+    gen_argv[g++] = (char *)mathgen_bin;
+    for (int i = 0; i < NUM_GEN_OPTS; i++) {
+        if (!gen_values[i]) continue;
+        gen_flags[i][0] = '-';
+        gen_flags[i][1] = GEN_OPTS[i];
+        gen_flags[i][2] = '\0';
+        gen_argv[g++] = gen_flags[i];
+        gen_argv[g++] = gen_values[i];
+    }
+    gen_argv[g++] = "-o";
+    gen_argv[g++] = trace_path;
+    gen_argv[g] = NULL;
+    if (run(gen_argv) != 0) {
+        printf("Error: trace generation failed\n");
+        unlink(trace_path);
+        return 1;
+    }
+
+    double ops = strtod(num_ops, NULL);
+    double base = 0.0;
+    printf("%-8s %12s %10s %14s %8s %14s\n", "threads", "ops", "seconds", "ops/s", "speedup", "out bytes/s");
+
+    long threads = 1;
+    while (1) {
+        char thread_arg[32];
+        snprintf(thread_arg, sizeof(thread_arg), "%ld", threads);
+        char *server_argv[] = {
+            (char *)mathserver_bin, "-t", thread_arg, streaming ? "-s" : trace_path,
+            streaming ? trace_path : output_path, streaming ? output_path : NULL, NULL
+        };
+
+        double best = 0.0;
+        for (int r = 0; r < repeats; r++) {
+            uint64_t start = now_ns();
+            if (run(server_argv) != 0) {
+                printf("Error: mathserver failed with %ld threads\n", threads);
+                unlink(trace_path);
+                unlink(output_path);
+                return 1;
+            }
+            double elapsed = (double)(now_ns() - start) * 1e-9;
+            if (r == 0 || elapsed < best) {
+                best = elapsed;
+            }
+        }
+
+        struct stat st;
+        double out_bytes = stat(output_path, &st) == 0 ? (double)st.st_size : 0.0;
+        if (threads == 1) {
+            base = best;
+        }
+        printf("%-8ld %12.0f %10.3f %14.0f %8.2f %14.0f\n", threads, ops, best,
+               best > 0.0 ? ops / best : 0.0, base > 0.0 && best > 0.0 ? base / best : 0.0,
+               best > 0.0 ? out_bytes / best : 0.0);
+        fflush(stdout);
+
+        if (threads == max_threads) break;
+        threads = threads * 2 > max_threads ? max_threads : threads * 2;
+    }
+
+    unlink(trace_path);
+    unlink(output_path);
+    return 0;
+}
@@ -0,0 +1,67 @@
+#ifndef MATHUTIL_H
+#define MATHUTIL_H
+
+#include <stdint.h>
+#include <time.h>
+
+/* Helpers shared by mathserver and its tools (mathload, mathgen,
+ * mathserver_bench). Everything is static inline, so each program still
+ * builds from its one .c file. */
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* splitmix64: small, fast and fully determined by the seed */
+static inline uint64_t rng_next(uint64_t *state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/* Uniform in [0, bound) */
+static inline uint32_t rng_below(uint64_t *state, uint32_t bound) {
+    return (uint32_t)(((rng_next(state) >> 32) * (uint64_t)bound) >> 32);
+}
+
+/* Uniform in [0, 1) */
+static inline double rng_unit(uint64_t *state) {
+    return (double)(rng_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* HDR-style log-linear histogram: exact below HIST_SUB, then HIST_SUB
+ * steps per power of two, so any uint64_t fits in HIST_BUCKETS */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+static inline int hist_bucket(uint64_t v) {
+    if (v < HIST_SUB) return (int)v;
+    int e = 63 - __builtin_clzll(v);
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB + (int)((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Smallest value that lands in bucket b */
+static inline uint64_t hist_value(int b) {
+    if (b < HIST_SUB) return (uint64_t)b;
+    int e = b / HIST_SUB + HIST_SUB_BITS - 1;
+    return (uint64_t)(HIST_SUB + b % HIST_SUB) << (e - HIST_SUB_BITS);
+}
+
+/* Bucket value at the pct-th percentile of total recorded values */
+static inline uint64_t hist_percentile(const uint64_t *hist, uint64_t total, double pct) {
+    if (total == 0) return 0;
+    uint64_t rank = (uint64_t)((double)total * pct / 100.0);
+    if (rank >= total) rank = total - 1;
+    uint64_t seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen > rank) return hist_value(b);
+    }
+    return 0;
+}
+
+#endif